@@ -0,0 +1,2 @@
+#define VERSION ""
+#define COMMIT "805b6ac444e866019a42ac66c92a788fe8b78060"
@@ -0,0 +1,290 @@
+/*
+ Copyright (c) 2019-2020 Fredrik Öhrström
+
+ MIT License
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef XMQ_RAPIDXML_H
+#define XMQ_RAPIDXML_H
+
+#include "xmq.h"
+
+#include "rapidxml/rapidxml.hpp"
+
+#include <string.h>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+struct ParseActionsRapidXML final : xmq::ParseActions
+{
+private:
+    rapidxml::xml_document<> *doc;
+    // The names and values that appear as they are in the input point into the input.
+    bool refer_to_input {};
+
+    // The names allocated so far, each distinct name is only copied once into the document.
+    struct Name
+    {
+        const char *s;
+        size_t len;
+        bool operator==(const Name &n) const { return len == n.len && !memcmp(s, n.s, len); }
+    };
+    struct NameHash
+    {
+        // In the library, it shares the hash of the other name tables.
+        size_t operator()(const Name &n) const;
+    };
+    std::unordered_set<Name,NameHash> names;
+
+    // A part owns its document. The nodes moved out of a part stay in the memory of the part,
+    // thus the parts that have been appended are kept for as long as these ParseActions live.
+    std::unique_ptr<rapidxml::xml_document<>> part_doc;
+    std::vector<std::unique_ptr<ParseActionsRapidXML>> parts;
+
+public:
+    // With refer_to_input the document points into the parsed input, which must outlive it.
+    ParseActionsRapidXML(rapidxml::xml_document<> *d, bool refer_to_input = false) :
+        doc(d), refer_to_input(refer_to_input) {}
+
+    void *root()
+    {
+        return doc;
+    }
+
+    char *allocateCopy(const char *content, size_t len)
+    {
+        // The length counts the terminating zero, which need not follow the content.
+        char *s = doc->allocate_string(NULL, len);
+        memcpy(s, content, len-1);
+        s[len-1] = 0;
+        return s;
+    }
+
+    char *allocateName(const char *content, size_t len)
+    {
+        auto i = names.find(Name { content, len-1 });
+        if (i != names.end()) return (char*)i->s;
+        char *s = allocateCopy(content, len);
+        names.insert(Name { s, len-1 });
+        return s;
+    }
+
+    bool referToInput()
+    {
+        return refer_to_input;
+    }
+
+    // The sizes are always given, since the tokens need not be zero terminated.
+    rapidxml::xml_node<> *allocateNode(rapidxml::node_type type, const xmq::Token *name, const xmq::Token *val)
+    {
+        rapidxml::xml_node<> *n = doc->allocate_node(type);
+        if (name) n->name(name->value, name->len);
+        if (val) n->value(val->value, val->len);
+        return n;
+    }
+
+    void *appendElement(void *parent, xmq::Token t)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        rapidxml::xml_node<> *n = allocateNode(rapidxml::node_element, &t, NULL);
+        p->append_node(n);
+        return n;
+    }
+
+    void appendComment(void *parent, xmq::Token t)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        p->append_node(allocateNode(rapidxml::node_comment, NULL, &t));
+    }
+
+    void appendData(void *parent, xmq::Token t)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        p->append_node(allocateNode(rapidxml::node_data, NULL, &t));
+    }
+
+    void appendAttribute(void *parent, xmq::Token key, xmq::Token val)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        rapidxml::xml_attribute<> *a = doc->allocate_attribute();
+        a->name(key.value, key.len);
+        a->value(val.value, val.len);
+        p->append_attribute(a);
+    }
+
+    void appendCData(void *parent, xmq::Token t)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        p->append_node(allocateNode(rapidxml::node_cdata, NULL, &t));
+    }
+
+    void appendPI(void *parent, xmq::Token name, xmq::Token val)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        p->append_node(allocateNode(rapidxml::node_pi, &name, &val));
+    }
+
+    void appendDocType(void *parent, xmq::Token t)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        p->append_node(allocateNode(rapidxml::node_doctype, NULL, &t));
+    }
+
+    xmq::ParseActions *newPart()
+    {
+        ParseActionsRapidXML *part = new ParseActionsRapidXML(new rapidxml::xml_document<>(), refer_to_input);
+        part->part_doc.reset(part->doc);
+        return part;
+    }
+
+    void appendPart(void *parent, xmq::ParseActions *pa)
+    {
+        ParseActionsRapidXML *part = (ParseActionsRapidXML*)pa;
+        parts.push_back(std::unique_ptr<ParseActionsRapidXML>(part));
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        while (rapidxml::xml_node<> *n = part->doc->first_node())
+        {
+            part->doc->remove_first_node();
+            p->append_node(n);
+        }
+    }
+
+};
+
+struct RenderActionsRapidXML final : xmq::RenderActions
+{
+private:
+    rapidxml::xml_node<> *root_;
+
+public:
+
+    RenderActionsRapidXML(rapidxml::xml_node<>* r) : root_(r) {}
+
+    void *root()
+    {
+        return root_;
+    }
+
+    void *firstNode(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->first_node();
+    }
+
+    void *nextSibling(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->next_sibling();
+    }
+
+    void *firstAttribute(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->first_attribute();
+    }
+
+    void *nextAttribute(void *attr)
+    {
+        rapidxml::xml_attribute<> *n = (rapidxml::xml_attribute<>*)attr;
+        return n->next_attribute();
+    }
+
+    void *parent(void *node)
+    {
+        rapidxml::xml_attribute<> *n = (rapidxml::xml_attribute<>*)node;
+        return n->parent();
+    }
+
+    bool isNodeData(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->type() == rapidxml::node_data;
+    }
+
+    bool isNodeComment(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->type() == rapidxml::node_comment;
+    }
+
+    bool isNodeCData(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->type() == rapidxml::node_cdata;
+    }
+
+    bool isNodePI(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->type() == rapidxml::node_pi;
+    }
+
+    bool isNodeDocType(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->type() == rapidxml::node_doctype;
+    }
+
+    bool isNodeDeclaration(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->type() == rapidxml::node_declaration;
+    }
+
+    xmq::NodeType nodeKind(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        switch (n->type())
+        {
+        case rapidxml::node_data: return xmq::NodeType::text;
+        case rapidxml::node_comment: return xmq::NodeType::comment;
+        case rapidxml::node_cdata: return xmq::NodeType::cdata;
+        case rapidxml::node_pi: return xmq::NodeType::pi;
+        case rapidxml::node_doctype: return xmq::NodeType::doctype;
+        case rapidxml::node_declaration: return xmq::NodeType::declaration;
+        default: return xmq::NodeType::open;
+        }
+    }
+
+    void loadName(void *node, xmq::str *name)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        name->s = n->name();
+        name->l = n->name_size();
+    }
+
+    void loadValue(void *node, xmq::str *data)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        data->s = n->value();
+        data->l = n->value_size();
+    }
+
+    bool hasAttributes(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        return n->first_attribute() != NULL;
+    }
+
+};
+
+#endif
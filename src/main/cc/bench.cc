@@ -0,0 +1,390 @@
+/*
+ Copyright (c) 2019-2020 Fredrik Öhrström
+
+ MIT License
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+// Measures the parse and render throughput of libxmq on synthetic documents.
+// Run it with: make bench
+// The output is tab separated, one line per corpus and operation, with a header line.
+// With --micro it instead measures the character classification on the xmq of the corpora.
+
+#include "xmq.h"
+#include "xmq_implementation.h"
+#include "xmq_rapidxml.h"
+
+#include "rapidxml/rapidxml.hpp"
+#include "rapidxml/rapidxml_print.hpp"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Counts the appended nodes and attributes, but builds nothing.
+// Used to measure the parser by itself.
+struct CountingParseActions : xmq::ParseActions
+{
+    size_t count {};
+    vector<char> scratch;
+    char element {}; // All elements share this handle, the root has another.
+
+    void *root() { return this; }
+    char *allocateCopy(const char *content, size_t len)
+    {
+        if (scratch.size() < len) scratch.resize(len);
+        // Like the other actions, len counts the zero terminator that we add ourselves.
+        memcpy(&scratch[0], content, len-1);
+        scratch[len-1] = 0;
+        return &scratch[0];
+    }
+    void *appendElement(void *parent, xmq::Token t) { count++; return &element; }
+    void appendComment(void *parent, xmq::Token t) { count++; }
+    void appendData(void *parent, xmq::Token t) { count++; }
+    void appendAttribute(void *parent, xmq::Token key, xmq::Token value) { count++; }
+    void appendCData(void *parent, xmq::Token t) { count++; }
+    void appendPI(void *parent, xmq::Token name, xmq::Token value) { count++; }
+    void appendDocType(void *parent, xmq::Token t) { count++; }
+};
+
+// Throws away the output, only the size is kept.
+struct CountingOutputWriter : xmq::OutputWriter
+{
+    size_t bytes {};
+
+    void write(const char *buf, size_t len) { bytes += len; }
+};
+
+// Lets rapidxml::print count the characters it prints.
+struct CountingOutputIterator
+{
+    size_t *bytes;
+
+    CountingOutputIterator(size_t *b) : bytes(b) {}
+    CountingOutputIterator &operator*() { return *this; }
+    CountingOutputIterator &operator=(char c) { (*bytes)++; return *this; }
+    CountingOutputIterator &operator++() { return *this; }
+    CountingOutputIterator operator++(int) { return *this; }
+};
+
+struct Corpus
+{
+    string name;
+    string xml;
+    string xmq;
+    size_t nodes {};
+};
+
+// The generators append elements to the xml until it has grown to size bytes.
+
+void generateDeep(string *xml, size_t size)
+{
+    *xml += "<deep>";
+    for (int i = 0; xml->size() < size; ++i)
+    {
+        for (int d = 0; d < 40; ++d) *xml += "<level>";
+        *xml += "bottom " + to_string(i);
+        for (int d = 0; d < 40; ++d) *xml += "</level>";
+    }
+    *xml += "</deep>";
+}
+
+void generateWide(string *xml, size_t size)
+{
+    *xml += "<wide>";
+    for (int i = 0; xml->size() < size; ++i)
+    {
+        *xml += "<item>" + to_string(i) + "</item>";
+    }
+    *xml += "</wide>";
+}
+
+void generateAttributes(string *xml, size_t size)
+{
+    *xml += "<table>";
+    for (int i = 0; xml->size() < size; ++i)
+    {
+        *xml += "<row";
+        for (int a = 0; a < 16; ++a)
+        {
+            *xml += " attribute" + to_string(a) + "=\"value" + to_string(i*16+a) + "\"";
+        }
+        *xml += "/>";
+    }
+    *xml += "</table>";
+}
+
+void generateText(string *xml, size_t size)
+{
+    *xml += "<book>";
+    for (int i = 0; xml->size() < size; ++i)
+    {
+        *xml += "<paragraph>";
+        for (int l = 0; l < 30; ++l)
+        {
+            *xml += "Line " + to_string(l) + " of paragraph " + to_string(i) + " goes on for a while before it ends.\n";
+        }
+        *xml += "</paragraph>";
+    }
+    *xml += "</book>";
+}
+
+void generateQuoting(string *xml, size_t size)
+{
+    *xml += "<quotes>";
+    for (int i = 0; xml->size() < size; ++i)
+    {
+        *xml += "<q a=\"it's\" b=\" padded \" c=\"x = {y}\">";
+        *xml += "'''" + to_string(i) + "''' // = { } it's ''quoted'' here";
+        *xml += "</q>";
+        *xml += "<e></e>";
+    }
+    *xml += "</quotes>";
+}
+
+void generateCorpus(Corpus *c, void (*generate)(string*,size_t), size_t size)
+{
+    generate(&c->xml, size);
+
+    xmq::Config config;
+    xmq::Document doc;
+    parseXML(&doc, c->name.c_str(), c->xml.c_str(), c->xml.size(), config);
+    xmq::DocumentRenderActions ractions(&doc);
+    vector<char> out;
+    renderXMQ(&ractions, &out, config);
+    c->xmq.assign(out.begin(), out.end());
+
+    CountingParseActions counter;
+    parseXMQ(&counter, c->name.c_str(), c->xmq.c_str(), c->xmq.size(), config);
+    c->nodes = counter.count;
+}
+
+// Run the operation runs times and return the fastest time in seconds.
+template<typename Op>
+double bestOf(int runs, Op op)
+{
+    double best = 0;
+    for (int r = 0; r < runs; ++r)
+    {
+        auto start = chrono::steady_clock::now();
+        op();
+        double s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (r == 0 || s < best) best = s;
+    }
+    return best;
+}
+
+void report(Corpus *c, const char *op, size_t bytes, double seconds)
+{
+    printf("%s\t%s\t%zu\t%zu\t%.6f\t%.1f\t%.0f\n",
+           c->name.c_str(), op, bytes, c->nodes, seconds,
+           bytes / seconds / 1000000.0, c->nodes / seconds);
+    fflush(stdout);
+}
+
+void benchmark(Corpus *c, int runs)
+{
+    const char *name = c->name.c_str();
+    xmq::Config config;
+
+    double s = bestOf(runs, [&]() {
+        CountingParseActions actions;
+        parseXMQ(&actions, name, c->xmq.c_str(), c->xmq.size(), config);
+    });
+    report(c, "parse_xmq", c->xmq.size(), s);
+
+    s = bestOf(runs, [&]() {
+        xmq::Document doc;
+        parseXMQ(&doc, name, c->xmq.c_str(), c->xmq.size(), config);
+    });
+    report(c, "parse_xmq_document", c->xmq.size(), s);
+
+    s = bestOf(runs, [&]() {
+        CountingParseActions actions;
+        parseXML(&actions, name, c->xml.c_str(), c->xml.size(), config);
+    });
+    report(c, "parse_xml", c->xml.size(), s);
+
+    xmq::Document doc;
+    parseXMQ(&doc, name, c->xmq.c_str(), c->xmq.size(), config);
+    xmq::DocumentRenderActions ractions(&doc);
+    size_t rendered = 0;
+    s = bestOf(runs, [&]() {
+        CountingOutputWriter out;
+        renderXMQ(&ractions, &out, config);
+        rendered = out.bytes;
+    });
+    report(c, "render_xmq", rendered, s);
+
+    s = bestOf(runs, [&]() {
+        xmq::Document xdoc;
+        parseXML(&xdoc, name, c->xml.c_str(), c->xml.size(), config);
+        xmq::DocumentRenderActions xactions(&xdoc);
+        CountingOutputWriter out;
+        renderXMQ(&xactions, &out, config);
+    });
+    report(c, "xml2xmq", c->xml.size(), s);
+
+    s = bestOf(runs, [&]() {
+        CountingOutputWriter out;
+        renderXMQFromXML(name, c->xml.c_str(), c->xml.size(), &out, config);
+    });
+    report(c, "xml2xmq_streamed", c->xml.size(), s);
+
+    s = bestOf(runs, [&]() {
+        rapidxml::xml_document<> rdoc;
+        // Like xmq2xml in main, the document points into the input.
+        ParseActionsRapidXML pactions(&rdoc, true);
+        parseXMQ(&pactions, name, c->xmq.c_str(), c->xmq.size(), config);
+        size_t printed = 0;
+        print(CountingOutputIterator(&printed), rdoc, 0);
+    });
+    report(c, "xmq2xml", c->xmq.size(), s);
+}
+
+// The comparison chains that the character class table replaced.
+bool isWhiteSpaceBranches(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool isReservedBranches(char c)
+{
+    return c == 0 || c == '\'' || c == '=' || c == '{' || c == '}' ||
+        c == '(' || c == ')' || isWhiteSpaceBranches(c);
+}
+
+bool isLineBreakBranches(char c)
+{
+    return c == '\n' || c == '\r';
+}
+
+bool isHtmlSpecialBranches(char c)
+{
+    switch (c)
+    {
+    case '&':
+    case '<':
+    case '>':
+        return true;
+    }
+    return false;
+}
+
+// Count the bytes of the xmq that the classifier accepts, the count keeps the loop from being optimised away.
+template<typename Classifier>
+void microbenchmark(Corpus *c, const char *function, const char *impl, int runs, Classifier classify)
+{
+    const char *s = c->xmq.c_str();
+    size_t len = c->xmq.size();
+    volatile size_t matches = 0;
+    double seconds = bestOf(runs, [&]() {
+        size_t n = 0;
+        for (size_t i = 0; i < len; ++i) n += classify(s[i]);
+        matches = n;
+    });
+    printf("%s\t%s\t%s\t%zu\t%.6f\t%.1f\n", c->name.c_str(), function, impl, len, seconds, len / seconds / 1000000.0);
+    fflush(stdout);
+}
+
+void microbenchmarks(Corpus *c, int runs)
+{
+    using namespace xmq_implementation;
+    microbenchmark(c, "isWhiteSpace", "branches", runs, isWhiteSpaceBranches);
+    microbenchmark(c, "isWhiteSpace", "table", runs, [](char ch) { return isWhiteSpace(ch); });
+    microbenchmark(c, "isReserved", "branches", runs, isReservedBranches);
+    microbenchmark(c, "isReserved", "table", runs, [](char ch) { return isReserved(ch); });
+    microbenchmark(c, "containsNewlines", "branches", runs, isLineBreakBranches);
+    microbenchmark(c, "containsNewlines", "table", runs, [](char ch) { return hasCharClass(ch, line_break); });
+    microbenchmark(c, "escapeHtml", "branches", runs, isHtmlSpecialBranches);
+    microbenchmark(c, "escapeHtml", "table", runs, [](char ch) { return hasCharClass(ch, html_special); });
+}
+
+struct Generator
+{
+    const char *name;
+    void (*generate)(string*,size_t);
+};
+
+Generator generators[] = {
+    { "deep", generateDeep },
+    { "wide", generateWide },
+    { "attributes", generateAttributes },
+    { "text", generateText },
+    { "quoting", generateQuoting },
+};
+
+int main(int argc, char **argv)
+{
+    size_t size = 4;
+    int runs = 3;
+    bool micro = false;
+    vector<string> selected;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strncmp(argv[i], "--size=", 7)) size = atoi(argv[i]+7);
+        else if (!strncmp(argv[i], "--runs=", 7)) runs = atoi(argv[i]+7);
+        else if (!strcmp(argv[i], "--micro")) micro = true;
+        else if (argv[i][0] == '-')
+        {
+            fprintf(stderr, "Usage: bench [--size=megabytes] [--runs=n] [--micro] [corpus...]\n"
+                    "Corpora: deep wide attributes text quoting\n");
+            return 1;
+        }
+        else selected.push_back(argv[i]);
+    }
+    if (size < 1 || runs < 1)
+    {
+        fprintf(stderr, "bench: size and runs must be at least 1\n");
+        return 1;
+    }
+
+    if (micro) printf("corpus\tfunction\timpl\tbytes\tseconds\tmb_per_s\n");
+    else printf("corpus\top\tbytes\tnodes\tseconds\tmb_per_s\tnodes_per_s\n");
+    try
+    {
+        for (auto &g : generators)
+        {
+            if (selected.size() > 0)
+            {
+                bool found = false;
+                for (auto &s : selected) if (s == g.name) found = true;
+                if (!found) continue;
+            }
+            Corpus c;
+            c.name = g.name;
+            generateCorpus(&c, g.generate, size*1000000);
+            if (micro) microbenchmarks(&c, runs);
+            else benchmark(&c, runs);
+        }
+    }
+    catch (xmq::Error &e)
+    {
+        fprintf(stderr, "bench: %s", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -25,15 +25,19 @@
 #include "cmdline.h"
 #include "util.h"
 
+#include<stdlib.h>
 #include<string.h>
 
 const char *manual = R"MANUAL(xmq - commandline xml-xmq converter [version ]
 Usage: xmq [options] <input>
+       xmq [options] --batch <inputs...>
   --color force coloring.
   --mono prevent coloring.
   --compress find common prefixes in tag names.
-  --exclude exlude tags.
+  --exclude exclude attributes and elements, -x @foo every foo attribute, -x bar@foo
+            foo in bar elements, -x bar the bar elements. A * matches any characters.
   --html assume that data is html, even though it does not start with an html tag.
+  --nocheck do not check that the input is valid utf8.
   --nodec do not add the xml/html5 declaration/doctype.
   --nopp do not pretty print xml/html.
   --output=html produce output suitable inclusion between <pre>...</pre> tags.
@@ -43,8 +47,37 @@ Usage: xmq [options] <input>
   -p preserve whitespace when converting from xml to xmq.
   --pp pretty print.
   -v view only, do not convert between xmq and xml/html.
+  --batch convert each of the inputs into its own output file, xml/html becomes .xmq
+          and xmq becomes .xml/.html, written next to the input.
+  --files-from=<file> read the batch inputs from the file, one per line, - reads stdin.
+  --outdir=<dir> write the batch outputs into this directory.
+  --align=<n> align at most n key = value lines in a row, the following lines are aligned
+              on their own. 0 means no limit, which is the default. When converting xml to xmq,
+              the lines of a run are held in memory, a limit bounds the memory used.
+  -j <n> convert with n threads in batch mode, default is one per cpu.
+         Otherwise parse and render the xmq with n threads, the children of the root node in parallel.
 )MANUAL";
 
+bool loadFileList(const char *list, std::vector<std::string> *files)
+{
+    InputBuffer buf;
+    bool rc = !strcmp(list, "-") ? loadStdin(&buf) : loadFile(list, &buf);
+    if (!rc) return false;
+
+    const char *p = buf.data();
+    const char *end = p+buf.size();
+    while (p < end)
+    {
+        const char *nl = (const char*)memchr(p, '\n', end-p);
+        if (nl == NULL) nl = end;
+        const char *e = nl;
+        if (e > p && e[-1] == '\r') e--;
+        if (e > p) files->push_back(std::string(p, e));
+        p = nl+1;
+    }
+    return true;
+}
+
 void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
 {
     int i = 1;
@@ -53,6 +86,7 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
         bool found = false;
         if (argc >= 2 && !strcmp(argv[i], "--color"))
         {
+            options->default_color = false;
             options->use_color = true;
             if (options->output == xmq::RenderType::plain)
             {
@@ -65,6 +99,7 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
         }
         if (argc >= 2 && !strcmp(argv[i], "--mono"))
         {
+            options->default_color = false;
             options->use_color = false;
             i++;
             argc--;
@@ -72,6 +107,7 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
         }
         if (argc >= 2 && !strcmp(argv[i], "--output=plain"))
         {
+            options->default_color = false;
             options->output = xmq::RenderType::plain;
             i++;
             argc--;
@@ -79,6 +115,7 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
         }
         if (argc >= 2 && !strcmp(argv[i], "--output=terminal"))
         {
+            options->default_color = false;
             options->output = xmq::RenderType::terminal;
             i++;
             argc--;
@@ -86,6 +123,7 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
         }
         if (argc >= 2 && !strcmp(argv[i], "--output=html"))
         {
+            options->default_color = false;
             options->output = xmq::RenderType::html;
             i++;
             argc--;
@@ -93,6 +131,7 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
         }
         if (argc >= 2 && !strcmp(argv[i], "--output=tex"))
         {
+            options->default_color = false;
             options->output = xmq::RenderType::tex;
             i++;
             argc--;
@@ -105,6 +144,13 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
             argc--;
             found = true;
         }
+        if (argc >= 2 && !strcmp(argv[i], "--nocheck"))
+        {
+            options->no_check = true;
+            i++;
+            argc--;
+            found = true;
+        }
         if (argc >= 2 && !strcmp(argv[i], "--nodec"))
         {
             // Do not print <?xml...> nor <!DOCTYPe...>
@@ -161,6 +207,56 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
             argc-=1;
             found = true;
         }
+        if (argc >= 2 && !strcmp(argv[i], "--batch"))
+        {
+            options->batch = true;
+            i++;
+            argc--;
+            found = true;
+        }
+        if (argc >= 2 && !strncmp(argv[i], "--files-from=", 13))
+        {
+            options->batch = true;
+            if (!loadFileList(argv[i]+13, &options->files))
+            {
+                exit(1);
+            }
+            i++;
+            argc--;
+            found = true;
+        }
+        if (argc >= 2 && !strncmp(argv[i], "--outdir=", 9))
+        {
+            options->outdir = argv[i]+9;
+            i++;
+            argc--;
+            found = true;
+        }
+        if (argc >= 2 && !strncmp(argv[i], "--align=", 8))
+        {
+            char *end;
+            options->align_limit = strtoul(argv[i]+8, &end, 10);
+            if (end == argv[i]+8 || *end != 0)
+            {
+                fprintf(stderr, "xmq: --align expects a number of lines\n");
+                exit(1);
+            }
+            i++;
+            argc--;
+            found = true;
+        }
+        if (argc >= 3 && !strcmp(argv[i], "-j"))
+        {
+            options->jobs = atoi(argv[i+1]);
+            if (options->jobs <= 0)
+            {
+                fprintf(stderr, "xmq: -j expects a positive number of threads\n");
+                exit(1);
+            }
+            i+=2;
+            argc-=2;
+            found = true;
+        }
         if (argc >= 2 && !strcmp(argv[i], "-v"))
         {
             options->view = true;
@@ -171,6 +267,26 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
         if (!found) break;
     }
 
+    if (options->batch)
+    {
+        if (options->view)
+        {
+            fprintf(stderr, "xmq: -v cannot be used with --batch\n");
+            exit(1);
+        }
+        for (; argv[i] != NULL; ++i)
+        {
+            options->files.push_back(argv[i]);
+        }
+        if (options->files.size() == 0)
+        {
+            puts(manual);
+            exit(0);
+        }
+        // The inputs are loaded by each conversion job.
+        return;
+    }
+
     const char *file = argv[i];
 
     if (file == NULL)
@@ -189,13 +305,12 @@ void parseCommandLine(CmdLineOptions *options, int argc, char **argv)
     }
     else
     {
-        std::string files = std::string(file);
-        bool rc = loadFile(files, options->in);
+        options->filename = file;
+        bool rc = loadFile(options->filename, options->in);
         if (!rc)
         {
             // Error message already printed by loadFile.
             exit(1);
         }
     }
-    options->in->push_back('\0');
 }
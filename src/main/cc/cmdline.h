@@ -26,13 +26,14 @@
 #define CMDLINE_H
 
 #include "xmq.h"
+#include "util.h"
 
 class CmdLineOptions
 {
 public:
-    CmdLineOptions(std::vector<char> *i, std::vector<char> *o) : in(i), out(o) {}
-    std::vector<char> *in;
-    std::vector<char> *out;
+    CmdLineOptions(InputBuffer *i, xmq::OutputWriter *o) : in(i), out(o) {}
+    InputBuffer *in;
+    xmq::OutputWriter *out;
 
     std::string filename;
     xmq::TreeType tree_type {};  // Set input type to: auto_detect, xml or html.
@@ -44,8 +45,16 @@ public:
     bool compress {};       // Find common prefixes of the tags.
     bool pp {};             // Do pretty print the xml/html.
     bool no_pp {};          // Do not pretty print the xml/html.
+    bool no_check {};       // Do not check that the input is valid utf8.
     std::set<std::string> excludes; // Exclude these attributes
     std::string root;       // If non-empty, check that the xmq has this root tag, if not then add it.
+    bool default_color {};  // Colors are on because stdout is a terminal, not because of an option.
+    bool batch {};          // Convert all the files, each into its own output file.
+    std::vector<std::string> files; // The files to convert in batch mode.
+    std::string outdir;     // Write the batch outputs here instead of next to the inputs.
+    size_t align_limit {};  // Align at most this many key = value lines in a row, 0 means no limit.
+    int jobs {};            // Number of threads converting in batch mode, 0 means one per cpu.
+                            // Otherwise the number of threads rendering xmq, 0 means one.
 };
 
 void parseCommandLine(CmdLineOptions *options, int argc, char **argv);
@@ -28,38 +28,268 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <memory>
+#include <unordered_map>
 
 using namespace std;
 using namespace xmq;
 
 xmq::Document::Document()
 {
-
+    // Index 0 means none, index 1 is the document.
+    nodes.resize(2);
+    nodes[1].type = NodeType::none;
+    attrs.resize(1);
+    // Offset 0 is the empty string.
+    texts.push_back(0);
+    names.resize(1024);
 }
 
 void *xmq::Document::root()
 {
-    return root_;
+    return nodeHandle(1);
 }
 
 char *xmq::Document::allocateCopy(const char *content, size_t len)
 {
-    return NULL;
+    size_t offset = texts.size();
+    if (offset+len > UINT32_MAX)
+    {
+        throw xmq::Error("xmq: document text exceeds 4GiB\n");
+    }
+    if (offset+len > texts.capacity())
+    {
+        // Move to a larger arena, the old one stays alive since tokens
+        // that are not yet appended can point into it.
+        vector<char> grown;
+        grown.reserve(max(2*texts.capacity(), offset+len));
+        grown.insert(grown.end(), texts.begin(), texts.end());
+        retired_texts.push_back(std::move(texts));
+        texts = std::move(grown);
+    }
+    texts.resize(offset+len);
+    memcpy(&texts[offset], content, len-1);
+    texts[offset+len-1] = 0;
+    return &texts[offset];
+}
+
+void xmq::Document::clear()
+{
+    nodes.resize(2);
+    nodes[1] = Node();
+    nodes[1].type = NodeType::none;
+    attrs.resize(1);
+    texts.resize(1);
+    retired_texts.clear();
+    if (num_names > 0)
+    {
+        fill(names.begin(), names.end(), NameSlot());
+        num_names = 0;
+    }
+}
+
+char *xmq::Document::allocateName(const char *content, size_t len)
+{
+    // The len includes the terminating zero.
+    if (len <= 1) return &texts[0];
+
+    if (2*(num_names+1) > names.size()) growNames();
+    uint32_t h = xmq_implementation::hashName(content, len-1);
+    size_t mask = names.size()-1;
+    for (size_t i = h & mask;; i = (i+1) & mask)
+    {
+        NameSlot &slot = names[i];
+        if (slot.offset == 0)
+        {
+            char *s = allocateCopy(content, len);
+            slot.offset = s-&texts[0];
+            slot.hash = h;
+            num_names++;
+            return s;
+        }
+        const char *name = &texts[slot.offset];
+        if (slot.hash == h && !strncmp(name, content, len-1) && name[len-1] == 0)
+        {
+            return &texts[slot.offset];
+        }
+    }
+}
+
+void xmq::Document::growNames()
+{
+    vector<NameSlot> grown(2*names.size());
+    size_t mask = grown.size()-1;
+    for (auto &slot : names)
+    {
+        if (slot.offset == 0) continue;
+        size_t i = slot.hash & mask;
+        while (grown[i].offset != 0) i = (i+1) & mask;
+        grown[i] = slot;
+    }
+    names.swap(grown);
+}
+
+uint32_t xmq::Document::addText(const Token &t, uint32_t *len)
+{
+    const char *s = t.value;
+    *len = t.len;
+    if (s >= &texts[0] && s < &texts[0]+texts.size() && s[t.len] == 0)
+    {
+        return s-&texts[0];
+    }
+    // The retired arenas are prefixes of the current arena.
+    for (auto &r : retired_texts)
+    {
+        if (s >= &r[0] && s < &r[0]+r.size() && s[t.len] == 0)
+        {
+            return s-&r[0];
+        }
+    }
+    // Not allocated by us, for example the --root name.
+    size_t offset = allocateCopy(s, t.len+1)-&texts[0];
+    return offset;
+}
+
+uint32_t xmq::Document::addNode(void *parent, NodeType type, Token name, Token value)
+{
+    if (nodes.size() >= UINT32_MAX/2)
+    {
+        throw xmq::Error("xmq: too many nodes in document\n");
+    }
+    uint32_t i = nodes.size();
+    uint32_t p = handleIndex(parent);
+    nodes.push_back(Node());
+    Node &n = nodes.back();
+    n.type = type;
+    n.name = name.value ? addText(name, &n.name_len) : 0;
+    n.value = value.value ? addText(value, &n.value_len) : 0;
+    n.parent = p;
+
+    Node &pn = nodes[p];
+    if (pn.last_child) nodes[pn.last_child].next_sibling = i;
+    else pn.first_child = i;
+    pn.last_child = i;
+
+    releaseRetiredTexts();
+    return i;
 }
 
 void *xmq::Document::appendElement(void *parent, Token t)
 {
-    return NULL;
+    return nodeHandle(addNode(parent, NodeType::open, t, Token(TokenType::none, NULL)));
 }
 
 void xmq::Document::appendComment(void *parent, Token t)
 {
+    addNode(parent, NodeType::comment, Token(TokenType::none, NULL), t);
 }
 
 void xmq::Document::appendData(void *parent, Token t)
 {
+    addNode(parent, NodeType::text, Token(TokenType::none, NULL), t);
 }
 
 void xmq::Document::appendAttribute(void *parent, Token key, Token value)
 {
+    uint32_t i = attrs.size();
+    attrs.push_back(Attribute());
+    Attribute &a = attrs.back();
+    a.key = addText(key, &a.key_len);
+    a.value = addText(value, &a.value_len);
+
+    Node &pn = nodes[handleIndex(parent)];
+    if (pn.last_attribute) attrs[pn.last_attribute].next_sibling = i;
+    else pn.first_attribute = i;
+    pn.last_attribute = i;
+
+    releaseRetiredTexts();
+}
+
+void xmq::Document::appendCData(void *parent, Token t)
+{
+    addNode(parent, NodeType::cdata, Token(TokenType::none, NULL), t);
+}
+
+void xmq::Document::appendPI(void *parent, Token name, Token value)
+{
+    addNode(parent, NodeType::pi, name, value);
+}
+
+void xmq::Document::appendDocType(void *parent, Token t)
+{
+    addNode(parent, NodeType::doctype, Token(TokenType::none, NULL), t);
+}
+
+xmq::ParseActions *xmq::Document::newPart()
+{
+    return new Document();
+}
+
+void xmq::Document::appendPart(void *parent, ParseActions *pa)
+{
+    unique_ptr<Document> part(static_cast<Document*>(pa));
+    if (nodes.size()+part->nodes.size() >= UINT32_MAX/2)
+    {
+        throw xmq::Error("xmq: too many nodes in document\n");
+    }
+    if (texts.size()+part->texts.size() > UINT32_MAX)
+    {
+        throw xmq::Error("xmq: document text exceeds 4GiB\n");
+    }
+
+    // The names of the part are interned here as well, a name keeps a single offset.
+    unordered_map<uint32_t,uint32_t> name_offsets;
+    for (auto &slot : part->names)
+    {
+        if (slot.offset == 0) continue;
+        const char *name = &part->texts[slot.offset];
+        name_offsets[slot.offset] = allocateName(name, strlen(name)+1)-&texts[0];
+    }
+    // The texts of the part are copied after ours, except the empty string at offset 0.
+    uint32_t text_base = texts.size()-1;
+    texts.insert(texts.end(), part->texts.begin()+1, part->texts.end());
+
+    uint32_t p = handleIndex(parent);
+    // Nodes 0 and 1 of the part are not copied, the document node of the part becomes parent.
+    uint32_t node_base = nodes.size()-2;
+    uint32_t attr_base = attrs.size()-1;
+    auto text = [&](uint32_t o) -> uint32_t { return o == 0 ? 0 : o+text_base; };
+    auto name = [&](uint32_t o) -> uint32_t
+    {
+        auto i = name_offsets.find(o);
+        return i != name_offsets.end() ? i->second : text(o);
+    };
+    auto node = [&](uint32_t i) -> uint32_t { return i == 0 ? 0 : i == 1 ? p : i+node_base; };
+    auto attr = [&](uint32_t i) -> uint32_t { return i == 0 ? 0 : i+attr_base; };
+
+    nodes.reserve(nodes.size()+part->nodes.size()-2);
+    for (size_t i = 2; i < part->nodes.size(); ++i)
+    {
+        Node n = part->nodes[i];
+        n.name = name(n.name);
+        n.value = text(n.value);
+        n.parent = node(n.parent);
+        n.next_sibling = node(n.next_sibling);
+        n.first_child = node(n.first_child);
+        n.last_child = node(n.last_child);
+        n.first_attribute = attr(n.first_attribute);
+        n.last_attribute = attr(n.last_attribute);
+        nodes.push_back(n);
+    }
+    attrs.reserve(attrs.size()+part->attrs.size()-1);
+    for (size_t i = 1; i < part->attrs.size(); ++i)
+    {
+        Attribute a = part->attrs[i];
+        a.key = name(a.key);
+        a.value = text(a.value);
+        a.next_sibling = attr(a.next_sibling);
+        attrs.push_back(a);
+    }
+
+    const Node &top = part->nodes[1];
+    if (top.first_child == 0) return;
+    Node &pn = nodes[p];
+    if (pn.last_child) nodes[pn.last_child].next_sibling = node(top.first_child);
+    else pn.first_child = node(top.first_child);
+    pn.last_child = node(top.last_child);
 }
@@ -33,21 +33,29 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <iostream>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
+#include <map>
 #include <set>
 
 using namespace std;
 
 bool detectTreeType(CmdLineOptions *options);
+int convert(CmdLineOptions *options, bool is_xmq);
+int convertBatch(CmdLineOptions *options);
 int xml2xmq(CmdLineOptions *options);
 int xmq2xml(CmdLineOptions *options);
 
 int main(int argc, char **argv)
 {
-    vector<char> in;
-    vector<char> out;
+    InputBuffer in;
+    // The output is written to stdout while it is being rendered.
+    FileOutputWriter out(1);
 
     CmdLineOptions options(&in, &out);
 
@@ -55,250 +63,352 @@ int main(int argc, char **argv)
     {
         options.use_color = true;
         options.output = xmq::RenderType::terminal;
+        options.default_color = true;
     }
 
     parseCommandLine(&options, argc, argv);
 
+    if (options.batch)
+    {
+        return convertBatch(&options);
+    }
+
     bool is_xmq = detectTreeType(&options);
-    int rc = 0;
+    return convert(&options, is_xmq);
+}
 
-    if (is_xmq)
+int convert(CmdLineOptions *options, bool is_xmq)
+{
+    try
     {
-        rc = xmq2xml(&options);
+        if (is_xmq)
+        {
+            return xmq2xml(options);
+        }
+        return xml2xmq(options);
     }
-    else
+    catch (xmq::Error &e)
     {
-        rc = xml2xmq(&options);
+        fputs(e.what(), stderr);
+        return 1;
     }
+}
 
-    if (rc == 0)
+// Replace the extension of the input file name, and move it into the outdir if there is one.
+string outputFileName(CmdLineOptions *options, const string &input, bool is_xmq)
+{
+    string ext = ".xmq";
+    if (is_xmq)
     {
-        out.push_back('\0');
-        printf("%s", &out[0]);
+        ext = options->tree_type == xmq::TreeType::html ? ".html" : ".xml";
     }
+    size_t slash = input.rfind('/');
+    size_t name_start = slash == string::npos ? 0 : slash+1;
+    size_t dot = input.rfind('.');
+    if (dot == string::npos || dot <= name_start) dot = input.size();
 
-    return rc;
+    string name = input.substr(0, dot)+ext;
+    if (options->outdir != "")
+    {
+        name = options->outdir+"/"+name.substr(name_start);
+    }
+    return name;
 }
 
-bool detectTreeType(CmdLineOptions *options)
+// Resolve the directory of the file, so that different paths to the same file compare equal.
+string canonicalName(const string &file)
 {
-    bool is_xmq = false == xmq_implementation::startsWithLessThan(*options->in);
+    size_t slash = file.rfind('/');
+    string dir = slash == string::npos ? "." : file.substr(0, slash+1);
+    char *real = realpath(dir.c_str(), NULL);
+    if (real == NULL) return file;
+    string name = string(real)+"/"+file.substr(slash == string::npos ? 0 : slash+1);
+    free(real);
+    return name;
+}
 
-    if (is_xmq)
+struct BatchJob
+{
+    string input;
+    string output;
+};
+
+// The name of the output depends on whether the input is xmq, xml or html.
+bool planJob(CmdLineOptions *batch_options, const string &file, BatchJob *job)
+{
+    InputBuffer in;
+    if (!loadFile(file, &in))
     {
-        if (options->tree_type == xmq::TreeType::auto_detect)
-        {
-            options->tree_type = xmq::TreeType::xml;
-            if (xmq_implementation::firstWordIsHtml(*options->in))
-            {
-                options->tree_type = xmq::TreeType::html;
-            }
-        }
+        return false;
     }
-    else
+    CmdLineOptions options = *batch_options;
+    options.in = &in;
+    bool is_xmq = detectTreeType(&options);
+    job->input = file;
+    job->output = outputFileName(&options, file, is_xmq);
+    return true;
+}
+
+// Refuse the batch if a job would write over an input, or over the output of another job.
+bool checkJobs(const vector<BatchJob> &jobs)
+{
+    map<string,const BatchJob*> inputs;
+    for (auto &j : jobs)
     {
-        if (options->tree_type == xmq::TreeType::auto_detect)
+        inputs[canonicalName(j.input)] = &j;
+    }
+    map<string,const BatchJob*> outputs;
+    for (auto &j : jobs)
+    {
+        string name = canonicalName(j.output);
+        auto i = inputs.find(name);
+        if (i != inputs.end())
         {
-            options->tree_type = xmq::TreeType::xml;
-            if (xmq_implementation::isHtml(*options->in))
+            if (i->second == &j)
             {
-                options->tree_type = xmq::TreeType::html;
+                fprintf(stderr, "xmq: %s would overwrite itself\n", j.input.c_str());
             }
+            else
+            {
+                fprintf(stderr, "xmq: %s would overwrite the input %s\n", j.input.c_str(), i->second->input.c_str());
+            }
+            return false;
+        }
+        auto o = outputs.find(name);
+        if (o != outputs.end())
+        {
+            fprintf(stderr, "xmq: %s and %s would both be written to %s\n",
+                    o->second->input.c_str(), j.input.c_str(), j.output.c_str());
+            return false;
         }
+        outputs[name] = &j;
     }
-    return is_xmq;
+    return true;
 }
 
-StringCount string_count_;
-int num_prefixes_ {};
-map<string,int> prefixes_;
-
-void shiftLeft(char *s, size_t l)
+// A batch job has its own input, output and options, nothing is shared with the other jobs.
+int convertFile(CmdLineOptions *batch_options, const BatchJob &job)
 {
-    size_t len = strlen(s);
-    assert(l <= len);
-    size_t newlen = len - l;
-    for (size_t i=0; i<newlen; ++i)
+    InputBuffer in;
+    if (!loadFile(job.input, &in))
     {
-        s[i] = s[i+l];
+        return 1;
+    }
+    FileOutputWriter out(-1);
+    CmdLineOptions options = *batch_options;
+    options.in = &in;
+    options.out = &out;
+    options.filename = job.input;
+
+    bool is_xmq = detectTreeType(&options);
+    if (!out.open(job.output))
+    {
+        return 1;
     }
-    s[newlen] = 0;
+    int rc = convert(&options, is_xmq);
+    if (rc != 0)
+    {
+        // Do not leave a half written output behind.
+        unlink(job.output.c_str());
+    }
+    return rc;
 }
 
-void find_all_strings(rapidxml::xml_node<> *i, StringCount &c)
+int convertBatch(CmdLineOptions *options)
 {
-    if (i->type() == rapidxml::node_element)
+    if (options->default_color)
     {
-        add_string(i->name(), c);
-        rapidxml::xml_attribute<> *a = i->first_attribute();
-        while (a != NULL)
-        {
-            add_string(a->name(), c);
-            a = a->next_attribute();
-        }
-        rapidxml::xml_node<> *n = i->first_node();
-        while (n != NULL)
+        // Colors were only picked because stdout is a terminal, the outputs are files.
+        options->use_color = false;
+        options->output = xmq::RenderType::plain;
+    }
+
+    // All the output names are decided before any output is written.
+    vector<BatchJob> jobs;
+    int unreadable = 0;
+    for (auto &f : options->files)
+    {
+        BatchJob job;
+        if (planJob(options, f, &job)) jobs.push_back(job);
+        else unreadable++;
+    }
+    if (!checkJobs(jobs))
+    {
+        return 1;
+    }
+
+    size_t num_threads = options->jobs;
+    if (num_threads == 0)
+    {
+        num_threads = thread::hardware_concurrency();
+    }
+    num_threads = max((size_t)1, min(num_threads, jobs.size()));
+
+    atomic<size_t> next {0};
+    atomic<int> failures {unreadable};
+    auto worker = [&]()
+    {
+        for (;;)
         {
-            find_all_strings(n, c);
-            n = n->next_sibling();
+            size_t i = next++;
+            if (i >= jobs.size()) break;
+            if (convertFile(options, jobs[i]) != 0) failures++;
         }
+    };
+
+    vector<thread> threads;
+    for (size_t i = 1; i < num_threads; ++i)
+    {
+        threads.push_back(thread(worker));
     }
+    worker();
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    return failures > 0 ? 1 : 0;
 }
 
-void find_all_prefixes(rapidxml::xml_node<> *i, StringCount &c)
+bool detectTreeType(CmdLineOptions *options)
 {
-    if (i->type() == rapidxml::node_element)
+    const char *buf = options->in->data();
+    size_t len = options->in->size();
+    bool is_xmq = false == xmq_implementation::startsWithLessThan(buf, len);
+
+    if (is_xmq)
     {
-        fprintf(stderr, "A1\n");
-        string p = find_prefix(i->name(), c);
-        if (p.length() > 5)
+        if (options->tree_type == xmq::TreeType::auto_detect)
         {
-            fprintf(stderr, "A2\n");
-            int pn = 0;
-            if (prefixes_.count(p) > 0)
-            {
-                pn = prefixes_[p];
-            }
-            else
+            options->tree_type = xmq::TreeType::xml;
+            if (xmq_implementation::firstWordIsHtml(buf, len))
             {
-                pn = num_prefixes_;
-                prefixes_[p] = pn;
-                num_prefixes_++;
+                options->tree_type = xmq::TreeType::html;
             }
-            shiftLeft(i->name(), p.length()-2);
-            i->name()[0] = 48+pn;
-            i->name()[1] = ':';
         }
-        rapidxml::xml_attribute<> *a = i->first_attribute();
-        while (a != NULL)
+    }
+    else
+    {
+        if (options->tree_type == xmq::TreeType::auto_detect)
         {
-            fprintf(stderr, "x1\n");
-            string p = find_prefix(a->name(), c);
-            fprintf(stderr, "x2\n");
-            if (p.length() > 5)
+            options->tree_type = xmq::TreeType::xml;
+            if (xmq_implementation::isHtml(buf, len))
             {
-                fprintf(stderr, "x3\n");
-                int pn = 0;
-                if (prefixes_.count(p) > 0)
-                {
-                    pn = prefixes_[p];
-                }
-                else
-                {
-                    pn = num_prefixes_;
-                    prefixes_[p] = pn;
-                    num_prefixes_++;
-                }
-                shiftLeft(a->name(), p.length()-2);
-                a->name()[0] = 48+pn;
-                a->name()[1] = ':';
+                options->tree_type = xmq::TreeType::html;
             }
-
-            a = a->next_attribute();
-            fprintf(stderr, "x4\n");
-        }
-        rapidxml::xml_node<> *n = i->first_node();
-        while (n != NULL)
-        {
-            fprintf(stderr, "Na\n");
-            find_all_prefixes(n, c);
-            fprintf(stderr, "Nb\n");
-            n = n->next_sibling();
-            fprintf(stderr, "Nc\n");
         }
     }
+    return is_xmq;
 }
 
 int xml2xmq(CmdLineOptions *options)
 {
-    vector<char> *buffer = options->in;
+    char *buffer = options->in->data();
 
-    xmq::Document ddoc;
-    xmq::Config s;
-    parseXML(&ddoc, "", &(*buffer)[0], s);
-
-    rapidxml::xml_document<> doc;
-    try
+    // Check its valid utf8.
+    if (!options->no_check)
     {
-        int flags =
-            rapidxml::parse_doctype_node |
-            rapidxml::parse_pi_nodes |
-            rapidxml::parse_comment_nodes |
-            rapidxml::parse_no_string_terminators;
-
-        if (!options->preserve_ws)
-        {
-            flags |= rapidxml::parse_trim_whitespace;
-        }
-        if (options->tree_type == xmq::TreeType::html)
-        {
-            flags |= rapidxml::parse_void_elements;
-        }
-        doc.parse(&(*buffer)[0], flags);
-
+        xmq_implementation::checkUtf8(options->filename.c_str(), buffer, options->in->size());
     }
-    catch (rapidxml::parse_error pe)
-    {
-        const char *where = pe.where<const char>();
-        //size_t offset = where - &(*buffer)[0];
-        const char *from = xmq_implementation::findStartingNewline(where, &(*buffer)[0]);
-        const char *to = xmq_implementation::findEndingNewline(where);
-        int line, col;
-        xmq_implementation::findLineAndColumn(&(*buffer)[0], where, &line, &col);
 
-        size_t count = to-from;
+    xmq::Config pconfig;
+    pconfig.tree_type = options->tree_type;
+    pconfig.preserve_ws = options->preserve_ws;
 
-        // bad.xml:2:16 Parse error expected =
-        //     <block clean>
-        //                 ^
+    xmq::Config config;
+    config.render_type = options->output;
+    config.use_color = options->use_color;
+    config.excludes = options->excludes;
+    config.align_limit = options->align_limit;
+    // Batch mode already converts one file per thread.
+    bool parallel = !options->batch && options->jobs > 1;
 
-        fprintf(stderr, "%s:%d:%d Parse error %s\n%.*s\n",
-                options->filename.c_str(), line, col, pe.what(), (int)count, from);
-        for (int i=2; i<col; ++i) fprintf(stderr, " ");
-        fprintf(stderr, "^\n");
+    // Without compression or parallel rendering, the xmq is rendered while the xml is parsed.
+    if (!options->compress && !parallel)
+    {
+        config.tree_type = pconfig.tree_type;
+        config.preserve_ws = pconfig.preserve_ws;
+        xmq::renderXMQFromXML(options->filename.c_str(), buffer, options->in->size(), options->out, config);
+        return 0;
     }
-    rapidxml::xml_node<> *root = doc.first_node();
+    if (parallel) config.render_threads = options->jobs;
+
+    xmq::Document doc;
+    parseXML(&doc, options->filename.c_str(), buffer, options->in->size(), pconfig);
+    xmq::DocumentRenderActions ractions(&doc);
 
-    if (options->compress)
+    if (!options->compress)
     {
-        // This will find common prefixes.
-        fprintf(stderr, "UGKRA1\n");
-        find_all_strings(root, string_count_);
-        fprintf(stderr, "UGKRA2\n");
-        find_all_prefixes(root, string_count_);
-        fprintf(stderr, "UGKRA3\n");
+        xmq::renderXMQ(&ractions, options->out, config);
+        return 0;
+    }
 
-        for (auto &p : prefixes_)
-        {
-            printf("# %d=%s\n", p.second, p.first.c_str());
-        }
+    // Find the common prefixes, then render the names with the prefixes replaced by their numbers.
+    Prefixes prefixes;
+    find_all_strings(&ractions, prefixes.string_count);
+    find_all_prefixes(&ractions, &prefixes);
+
+    for (auto &p : prefixes.prefixes)
+    {
+        string line = "# "+to_string(p.second)+"="+p.first+"\n";
+        options->out->write(line.c_str(), line.size());
     }
 
-    RenderActionsRapidXML ractions(root);
-    xmq::Config config;
-    config.render_type = options->output;
-    config.use_color = options->use_color;
-    xmq::renderXMQ(&ractions, options->out, config);
+    CompressedRenderActions cactions(&ractions, &prefixes);
+    xmq::renderXMQ(&cactions, options->out, config);
     return 0;
 }
 
+// Lets rapidxml::print write its characters into an OutputSink.
+struct SinkOutputIterator
+{
+    xmq_implementation::OutputSink *sink;
+
+    SinkOutputIterator(xmq_implementation::OutputSink *s) : sink(s) {}
+    SinkOutputIterator &operator*() { return *this; }
+    SinkOutputIterator &operator=(char c) { sink->put(c); return *this; }
+    SinkOutputIterator &operator++() { return *this; }
+    SinkOutputIterator operator++(int) { return *this; }
+};
+
 int xmq2xml(CmdLineOptions *options)
 {
-    vector<char> *buffer = options->in;
+    InputBuffer *buffer = options->in;
     rapidxml::xml_document<> doc;
 
     // Check its valid utf8.
-//    int line, col;
-    /*
-    if (!isValidUtf8(buffer, &line, &col))
+    if (!options->no_check)
     {
-        fprintf(stderr, "%s:%d:%d Invalid UTF8!\n",
-                options->filename.c_str(), line, col);
-        return 1;
-        }*/
+        xmq_implementation::checkUtf8(options->filename.c_str(), buffer->data(), buffer->size());
+    }
 
     // Change any \r\n to \n.
-    removeCrs(buffer);
+    size_t len = buffer->size();
+    if (removeCrs(buffer->data(), &len))
+    {
+        buffer->truncate(len);
+    }
+
+    xmq::Config config;
+    config.root = options->root.c_str();
+    config.render_type = options->output;
+    config.use_color = options->use_color;
+    config.excludes = options->excludes;
+    config.align_limit = options->align_limit;
+    // Batch mode already converts one file per thread.
+    bool parallel = !options->batch && options->jobs > 1;
+
+    // Without a view or parallel parts, the xml is written while the xmq is parsed.
+    if (!options->view && !parallel)
+    {
+        bool html = options->tree_type == xmq::TreeType::html;
+        // Html generation defaults to no pretty printing, xml generation to pretty printing.
+        bool indent = html ? options->pp : !options->no_pp;
+        xmq_implementation::XMLWriter writer(options->out, html, indent);
+        if (!options->no_declaration) writer.appendDeclaration();
+        parseXMQ(&writer, options->filename.c_str(), buffer->data(), buffer->size(), config);
+        writer.finish();
+        return 0;
+    }
 
     if (!options->no_declaration)
     {
@@ -316,13 +426,15 @@ int xmq2xml(CmdLineOptions *options)
         }
     }
 
-    ParseActionsRapidXML pactions(&doc);
+    // The buffer outlives the document, thus the names and values can point into it.
+    ParseActionsRapidXML pactions(&doc, true);
 
-    xmq::Config config;
-    config.root = options->root.c_str();
-    config.render_type = options->output;
-    config.use_color = options->use_color;
-    parseXMQ(&pactions, options->filename.c_str(), &(*buffer)[0], config);
+    if (parallel)
+    {
+        config.render_threads = options->jobs;
+        config.parse_threads = options->jobs;
+    }
+    parseXMQ(&pactions, options->filename.c_str(), buffer->data(), buffer->size(), config);
 
     if (options->view)
     {
@@ -331,7 +443,6 @@ int xmq2xml(CmdLineOptions *options)
     }
     else
     {
-        string s;
         int flags = 0;
         if (options->tree_type == xmq::TreeType::html)
         {
@@ -352,8 +463,10 @@ int xmq2xml(CmdLineOptions *options)
                 flags |= rapidxml::print_no_indenting;
             }
         }
-        print(back_inserter(s), doc, flags);
-        options->out->insert(options->out->end(), s.begin(), s.end());
+        xmq_implementation::OutputSink sink(options->out, xmq_implementation::Escape::none);
+        print(SinkOutputIterator(&sink), doc, flags);
+        // Flush here, a write error is reported like any other error.
+        sink.flush();
     }
 
     return 0;
@@ -25,103 +25,181 @@
 #include "xmq.h"
 #include "xmq_implementation.h"
 #include "util.h"
+#include "xmq_rapidxml.h"
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 using namespace std;
 using namespace xmq;
 
+/*
+    Like the renderer, the parser is instantiated for the ParseActions of the
+    built in backends, thus the calls to them need not go through the vtable.
+*/
+template<typename Actions>
 class ParserImplementation
 {
 public:
-    ParserImplementation(xmq::ParseActions *pa) : parse_actions(pa) {}
+    ParserImplementation(Actions *pa) : parse_actions(pa) {}
 
 private:
-    ParseActions *parse_actions {};
+    Actions *parse_actions {};
     const char *file {};
-    const char *buf {};
     const char *root {};
-    size_t buf_len {};
-    size_t pos {};
-    int line {};
-    int col {};
+    int threads {};
+    // The children of the elements directly below top are parsed in parallel.
+    void *top {};
+    // A part holds a range of children, thus it may have more than one top level node.
+    bool is_part {};
+    size_t pos {}; // Offset from the start of the input. Line and column are only found when an error is reported.
+
+    // The parser sees the input through a window. When parsing a buffer
+    // the window is the whole buffer. When streaming from an InputReader
+    // the window is refilled on demand and bytes before the current token
+    // are discarded, thus memory use is bounded by the largest token
+    // rather than the size of the input.
+    const char *buf {};     // The window, buf[0] is the byte at offset buf_start.
+    size_t buf_start {};    // Offset of buf[0] from the start of the input.
+    size_t buf_len {};      // Number of valid bytes in the window.
+    InputReader *reader {}; // Set when streaming.
+    vector<char> window;    // Storage for the window when streaming.
+    vector<char> scratch;   // Reused when decoding quotes and comments that span lines.
+    vector<void*> open_nodes; // The parents of the elements whose children are being parsed.
+    bool refer_to_input {}; // Text found as it is in the input is passed on as a slice of the input.
+    bool reader_eof {};
+    size_t mark {};         // Start of the current token, must stay in the window.
+    long last_discarded_nl {-1}; // Offset of the last newline discarded from the window.
+    int discarded_lines {};      // Number of newlines discarded from the window.
+
+    // Return the byte at offset p, or 0 at the end of the input.
+    char at(size_t p)
+    {
+        size_t i = p - buf_start;
+        if (i < buf_len) return buf[i];
+        return fill(p);
+    }
+    char fill(size_t p);
+    const char *ptr(size_t p) { return buf + (p - buf_start); }
+
+    // Scan forward from p, refilling the window when the scanner reaches its end.
+    // Returns the offset where the scanner stopped, or the end of the input.
+    template<typename Scanner>
+    size_t scan(size_t p, Scanner scanner)
+    {
+        for (;;)
+        {
+            const char *b = ptr(p);
+            const char *e = buf+buf_len;
+            if (b < e)
+            {
+                const char *f = scanner(b, e);
+                p += f-b;
+                if (f < e) return p;
+            }
+            if (reader == NULL || reader_eof) return p;
+            fill(p);
+        }
+    }
+    // Find the line and column of offset p, it must be in the window.
+    void findLineAndColumn(size_t p, int *line, int *col);
 
     void eatWhiteSpace();
 
     void error(const char* fmt, ...);
     void errornoline(const char* fmt, ...);
 
-    int findIndent(int p);
-
-    bool isReservedCharacter(char c);
+    int findIndent(size_t p);
 
     TokenType peekToken();
-    Token eatToken();
+    // A text token that is an element or attribute name is allocated with allocateName.
+    Token eatToken(bool is_name = false);
     Token eatToEndOfComment();
     Token eatToEndOfLine();
     Token eatMultipleCommentLines();
-    Token eatToEndOfText();
-    void eatToEndOfQuote(int indent, vector<char> *buffer);
-    Token eatToEndOfQuotes(int indent);
+    Token eatToEndOfText(bool is_name);
+    // Find the content of the quote at pos and move pos past the quote.
+    void findQuoteContent(size_t *from, size_t *to, int *first_indent);
+    Token eatToEndOfQuotes();
 
     // Syntax
     void parseComment(void *parent);
-    void parseNode(void *parent);
+    // Returns the node when its children follow, the { has then been eaten.
+    void *parseNode(void *parent);
+    void parseClosingBrace();
+    void parseChildrenInParallel(void *node);
     void parseAttributes(void *parent);
 
     size_t findDepth(size_t p, int *depth);
     bool isEndingWithDepth(size_t p, int depth);
     size_t potentiallySkipLeading_WS_NL_WS(size_t p);
-    void potentiallyRemoveEnding_WS_NL_WS(vector<char> *buffer);
+    size_t potentiallyRemoveEnding_WS_NL_WS(const char *start, size_t len);
     void trimTokenWhiteSpace(Token *t);
 
     void padWithSingleSpaces(Token *t);
 
 public:
-    void setup(ParseActions *a, const char *f, const char *b, const char *r)
+    void setup(Actions *a, const char *f, const char *b, size_t len, const char *r)
     {
         parse_actions = a;
         file = f;
         buf = b;
-        buf_len = strlen(buf);
+        buf_start = 0;
+        buf_len = len;
         root = r;
         pos = 0;
-        line = 1;
-        col = 1;
+        refer_to_input = a->referToInput();
     }
+    void setup(Actions *a, const char *f, InputReader *rd, const char *r)
+    {
+        setup(a, f, "", 0, r);
+        reader = rd;
+        refer_to_input = false;
+        window.resize(65536+1);
+        buf = &window[0];
+        window[0] = 0;
+    }
+    void setThreads(int t) { threads = t; }
     void parseXMQ(void *node);
     void parse();
 };
 
-void ParserImplementation::error(const char* fmt, ...)
+template<typename Actions>
+void ParserImplementation<Actions>::error(const char* fmt, ...)
 {
-    printf("%s:%d:%d: error: ", file, line, col);
+    int line, col;
+    findLineAndColumn(pos, &line, &col);
     va_list args;
     va_start(args, fmt);
-    vprintf(fmt, args);
+    string msg = xmq_implementation::errorMessage(file, line, col, fmt, args);
     va_end(args);
-    printf("\n");
 
-    printf("%.*s\n", col, &buf[pos-col+1]);
-    exit(1);
+    size_t from = pos-col+1;
+    if (from < buf_start) from = buf_start;
+    msg += string(ptr(from), pos-from)+"\n";
+    throw xmq::Error(msg);
 }
 
-void ParserImplementation::errornoline(const char* fmt, ...)
+template<typename Actions>
+void ParserImplementation<Actions>::errornoline(const char* fmt, ...)
 {
-    printf("%s:%d:%d: error: ", file, line, col);
+    int line, col;
+    findLineAndColumn(pos, &line, &col);
     va_list args;
     va_start(args, fmt);
-    vprintf(fmt, args);
+    string msg = xmq_implementation::errorMessage(file, line, col, fmt, args);
     va_end(args);
-    printf("\n");
 
-    exit(1);
+    throw xmq::Error(msg);
 }
 
-void ParserImplementation::trimTokenWhiteSpace(Token *t)
+template<typename Actions>
+void ParserImplementation<Actions>::trimTokenWhiteSpace(Token *t)
 {
-    size_t len = strlen(t->value);
+    size_t len = t->len;
     // Trim away whitespace at the beginning.
     while (len > 0 && *t->value != 0)
     {
@@ -136,69 +214,95 @@ void ParserImplementation::trimTokenWhiteSpace(Token *t)
         if (!xmq_implementation::isWhiteSpace(t->value[len-1])) break;
         len--;
     }
+    t->len = len;
 }
 
 
-void ParserImplementation::padWithSingleSpaces(Token *t)
+template<typename Actions>
+void ParserImplementation<Actions>::padWithSingleSpaces(Token *t)
 {
-    size_t len = strlen(t->value);
+    size_t len = t->len;
     char buf[len+3]; // Two spaces and zero terminator.
     buf[0] = ' ';
     memcpy(buf+1, t->value, len);
     buf[1+len] = ' ';
     buf[2+len] = 0;
     t->value = parse_actions->allocateCopy(buf, len+3);
+    t->len = len+2;
 }
 
-int ParserImplementation::findIndent(int p)
+template<typename Actions>
+char ParserImplementation<Actions>::fill(size_t p)
 {
-    int count = 0;
-    while (p >= 0 && buf[p] != '\n')
+    assert(p >= buf_start);
+    while (reader != NULL && !reader_eof && p >= buf_start+buf_len)
     {
-        p--;
-        count++;
+        if (buf_len == window.size()-1)
+        {
+            // The window is full. Discard everything before the current token,
+            // but remember where the last discarded line started, findIndent needs it.
+            size_t discard = mark - buf_start;
+            if (discard > 0)
+            {
+                const char *nl = (const char*)memrchr(buf, '\n', discard);
+                if (nl != NULL) last_discarded_nl = buf_start + (nl - buf);
+                discarded_lines += xmq_implementation::countNewlines(buf, buf+discard);
+                memmove(&window[0], &window[discard], buf_len-discard);
+                buf_start += discard;
+                buf_len -= discard;
+            }
+            else
+            {
+                // A single token fills the window, make room for more.
+                window.resize(2*window.size()-1);
+                buf = &window[0];
+            }
+        }
+        size_t n = reader->read(&window[buf_len], window.size()-1-buf_len);
+        if (n == 0) reader_eof = true;
+        buf_len += n;
+        window[buf_len] = 0;
     }
-    return count;
+    if (p < buf_start+buf_len) return buf[p-buf_start];
+    return 0;
 }
 
-bool ParserImplementation::isReservedCharacter(char c)
+template<typename Actions>
+int ParserImplementation<Actions>::findIndent(size_t p)
 {
-    return
-        c == 0 ||
-        c == '\'' ||
-        c == '=' ||
-        c == '{' ||
-        c == '}' ||
-        c == '(' ||
-        c == ')' ||
-        c == ' ' ||
-        c == '\t' ||
-        c == '\r' ||
-        c == '\n';
+    // Count the characters from the preceding newline, or from the start of the input.
+    size_t i = p;
+    while (i > buf_start && buf[i-buf_start] != '\n') i--;
+    if (buf[i-buf_start] == '\n') return p-i;
+    if (buf_start > 0) return (long)p-last_discarded_nl;
+    return p+1;
 }
 
-void ParserImplementation::eatWhiteSpace()
+template<typename Actions>
+void ParserImplementation<Actions>::findLineAndColumn(size_t p, int *line, int *col)
 {
-    while (true)
+    xmq_implementation::NewlineIndex index(buf, buf_len);
+    index.lookup(p-buf_start, line, col);
+    if (buf_start > 0)
     {
-        char c = buf[pos];
-        if (c == 0) break;
-        else if (xmq_implementation::isNewLine(c))
-        {
-            col = 1;
-            line++;
-        }
-        else if (!xmq_implementation::isWhiteSpace(c)) break;
-        pos++;
-        col++;
+        // Streaming, the window does not start at the beginning of the input.
+        if (*line == 1) *col = p-last_discarded_nl;
+        *line += discarded_lines;
     }
 }
 
-TokenType ParserImplementation::peekToken()
+template<typename Actions>
+void ParserImplementation<Actions>::eatWhiteSpace()
+{
+    pos = scan(pos, xmq_implementation::skipWhiteSpace);
+}
+
+template<typename Actions>
+TokenType ParserImplementation<Actions>::peekToken()
 {
     eatWhiteSpace();
 
-    char c = buf[pos];
+    char c = at(pos);
 
     switch (c)
     {
@@ -210,18 +314,20 @@ TokenType ParserImplementation::peekToken()
     case '(': return TokenType::paren_open;
     case ')': return TokenType::paren_close;
     }
-    if (c == '/' && (buf[pos+1] == '/' || buf[pos+1] == '*')) return TokenType::comment;
+    if (c == '/' && (at(pos+1) == '/' || at(pos+1) == '*')) return TokenType::comment;
     return TokenType::text;
 }
 
-Token ParserImplementation::eatToken()
+template<typename Actions>
+Token ParserImplementation<Actions>::eatToken(bool is_name)
 {
     TokenType tt = peekToken();
+    mark = pos;
     switch (tt)
     {
-    case TokenType::none: return Token(TokenType::none, "");
-    case TokenType::text: return eatToEndOfText();
-    case TokenType::quote: return eatToEndOfQuotes(col);
+    case TokenType::none: return Token(TokenType::none, "", 0);
+    case TokenType::text: return eatToEndOfText(is_name);
+    case TokenType::quote: return eatToEndOfQuotes();
     case TokenType::comment: return eatToEndOfComment();
     case TokenType::equals:
     case TokenType::brace_open:
@@ -229,49 +335,36 @@ Token ParserImplementation::eatToken()
     case TokenType::paren_open:
     case TokenType::paren_close:
         pos++;
-        return Token(tt, ""); // Do not bother to store the string of the char itself.
+        return Token(tt, "", 0); // Do not bother to store the string of the char itself.
     }
     assert(0);
     return Token(TokenType::none, "");
 }
 
-Token ParserImplementation::eatToEndOfText()
+template<typename Actions>
+Token ParserImplementation<Actions>::eatToEndOfText(bool is_name)
 {
     size_t start = pos;
-    size_t i = pos;
-    while (true)
+    size_t i = scan(pos, xmq_implementation::findReservedCharacter);
+    pos = i;
+    if (at(i) == '\n')
     {
-        char c = buf[i];
-        if (c == 0)
-        {
-            pos = i;
-            break;
-        }
-        if (c == '\n')
-        {
-            pos = i+1;
-            line++;
-            col = 1;
-            break;
-        }
-        if (isReservedCharacter(c))
-        {
-            pos = i;
-            break;
-        }
-        i++;
-        col++;
+        pos = i+1;
     }
     size_t len = i-start;
-    char *value = parse_actions->allocateCopy(buf+start, len+1);
+    if (refer_to_input) return Token(TokenType::text, ptr(start), len);
+    char *value = is_name ?
+        parse_actions->allocateName(ptr(start), len+1) :
+        parse_actions->allocateCopy(ptr(start), len+1);
 
-    return Token(TokenType::text, value);
+    return Token(TokenType::text, value, len);
 }
 
-size_t ParserImplementation::findDepth(size_t p, int *depth)
+template<typename Actions>
+size_t ParserImplementation<Actions>::findDepth(size_t p, int *depth)
 {
     int count = 0;
-    while (buf[p] == '\'')
+    while (at(p) == '\'')
     {
         p++;
         count++;
@@ -280,14 +373,17 @@ size_t ParserImplementation::findDepth(size_t p, int *depth)
     return p;
 }
 
-bool ParserImplementation::isEndingWithDepth(size_t p, int depth)
+template<typename Actions>
+bool ParserImplementation<Actions>::isEndingWithDepth(size_t p, int depth)
 {
-    while (buf[p] == '\'')
+    size_t start = p;
+    while (at(p) == '\'')
     {
         p++;
         depth--;
         if (depth < 0)
         {
+            pos = start; // Errors are reported at pos.
             error("too many quotes");
         }
     }
@@ -295,23 +391,25 @@ bool ParserImplementation::isEndingWithDepth(size_t p, int depth)
     return false;
 }
 
-size_t ParserImplementation::potentiallySkipLeading_WS_NL_WS(size_t p)
+template<typename Actions>
+size_t ParserImplementation<Actions>::potentiallySkipLeading_WS_NL_WS(size_t p)
 {
     size_t org_p = p;
     bool nl_found = false;
     for (;;)
     {
-        if (buf[p] == 0)
+        char c = at(p);
+        if (c == 0)
         {
             p = org_p;
             break;
         }
-        if (buf[p] == ' ')
+        if (c == ' ')
         {
             p++;
             continue;
         }
-        if (buf[p] == '\n')
+        if (c == '\n')
         {
             if (nl_found) break;
             nl_found = true;
@@ -326,10 +424,11 @@ size_t ParserImplementation::potentiallySkipLeading_WS_NL_WS(size_t p)
     return org_p;
 }
 
-void ParserImplementation::potentiallyRemoveEnding_WS_NL_WS(vector<char> *buffer)
+template<typename Actions>
+size_t ParserImplementation<Actions>::potentiallyRemoveEnding_WS_NL_WS(const char *start, size_t len)
 {
-    char *start = &(*buffer)[0];
-    char *p = &(*buffer)[buffer->size()-1];
+    if (len == 0) return 0;
+    const char *p = start+len-1;
     bool nl_found = false;
     for (;;)
     {
@@ -352,81 +451,87 @@ void ParserImplementation::potentiallyRemoveEnding_WS_NL_WS(vector<char> *buffer
         }
         break;
     }
-    if (nl_found)
-    {
-        // Only trim if there was a new line!
-        size_t len = 1+p-start;
-        buffer->resize(len);
-    }
+    // Only trim if there was a new line!
+    if (nl_found) return 1+p-start;
+    return len;
 }
 
-Token ParserImplementation::eatToEndOfQuotes(int indent)
+template<typename Actions>
+Token ParserImplementation<Actions>::eatToEndOfQuotes()
 {
-    assert(buf[pos] == '\'');
+    assert(at(pos) == '\'');
+
+    size_t from, to;
+    int first_indent;
+    findQuoteContent(&from, &to, &first_indent);
+
+    if (at(pos) != '\\')
+    {
+        // A single quote on one line is taken straight from the input.
+        const char *s = ptr(from);
+        if (memchr(s, '\n', to-from) == NULL)
+        {
+            if (refer_to_input) return Token(TokenType::text, s, to-from);
+            return Token(TokenType::text, parse_actions->allocateCopy(s, to-from+1), to-from);
+        }
+    }
 
-    vector<char> buffer;
+    scratch.clear();
     for (;;)
     {
-        assert(buf[pos] == '\'');
-        eatToEndOfQuote(indent, &buffer);
+        xmq_implementation::removeIncidentalWhiteSpace(ptr(from), to-from, first_indent, &scratch);
 
         // Now check if a \ is suffixed!
-        if (buf[pos] != '\\')
+        if (at(pos) != '\\')
         {
             // No quote joinging happening, lest stop.
             break;
         }
 
-        assert(buf[pos] == '\\');
-        if (buf[pos+1] != 'n' && buf[pos+1] != '\n')
+        assert(at(pos) == '\\');
+        if (at(pos+1) != 'n' && at(pos+1) != '\n')
         {
             error("expected n or newline after quote suffixed with \\.");
         }
-        if (buf[pos+1] == 'n' && buf[pos+2] != '\n')
+        if (at(pos+1) == 'n' && at(pos+2) != '\n')
         {
             error("expected newline after quote suffixed with \\n.");
         }
-        assert(buf[pos+1] == '\n' || (buf[pos+1] == 'n' && buf[pos+2] == '\n'));
+        assert(at(pos+1) == '\n' || (at(pos+1) == 'n' && at(pos+2) == '\n'));
 
         pos++; // Skip
-        if (buf[pos] == 'n')
+        if (at(pos) == 'n')
         {
             pos++; // Skip n
-            buffer.push_back('\n');
+            scratch.push_back('\n');
         }
 
-        assert(buf[pos] == '\n');
+        assert(at(pos) == '\n');
         // Detected '.....'\ followed by newline
         // or       '.....'\n followed by newline
         // Now skip whitespace.
         eatWhiteSpace();
         // Now we must have reached another quote.
-        if (buf[pos] != '\'')
+        if (at(pos) != '\'')
         {
             error("expected quote after quote suffixed with \\ or \\n.");
         }
+        findQuoteContent(&from, &to, &first_indent);
     }
 
-    char *value;
-    if (buffer.size() == 0)
-    {
-        value = parse_actions->allocateCopy("", 1);
-    }
-    else
-    {
-        value = parse_actions->allocateCopy(&buffer[0], buffer.size()+1);
-    }
-    return Token(TokenType::text, value);
-
+    char *value = parse_actions->allocateCopy(scratch.data(), scratch.size()+1);
+    return Token(TokenType::text, value, scratch.size());
 }
 
-void ParserImplementation::eatToEndOfQuote(int indent, vector<char> *buffer)
+template<typename Actions>
+void ParserImplementation<Actions>::findQuoteContent(size_t *from, size_t *to, int *first_indent)
 {
-    if (buf[pos] == '\'' && buf[pos+1] == '\'' && buf[pos+2] != '\'')
+    if (at(pos) == '\'' && at(pos+1) == '\'' && at(pos+2) != '\'')
     {
         // This is the empty string! ''
         pos += 2;
-        // Nothing needs to be added to the buffer.
+        *from = *to = pos;
+        *first_indent = 0;
         return;
     }
 
@@ -435,53 +540,42 @@ void ParserImplementation::eatToEndOfQuote(int indent, vector<char> *buffer)
     size_t start = findDepth(pos, &depth);
 
     // p now points the first character after the quotes.
-    size_t p = start;
     // If there is ws nl ws, then skip it.
-    p = potentiallySkipLeading_WS_NL_WS(p);
+    size_t p = potentiallySkipLeading_WS_NL_WS(start);
 
     // Remember the first lines offset into the line.
-    int first_indent = findIndent(p);
+    *first_indent = findIndent(p);
+    *from = p;
 
-    vector<char> quote;
+    auto findQuote = [](const char *b, const char *e) { return xmq_implementation::findCharOrZero(b, e, '\''); };
     while (true)
     {
-        char c = buf[p];
-        if (c == 0)
+        p = scan(p, findQuote);
+
+        if (at(p) == 0)
         {
+            pos = p;
             error("unexpected eof in quoted text");
         }
-        else
-        if (c == '\n')
-        {
-            quote.push_back('\n');
-            line++;
-            col = 1;
-            p++;
-            continue;
-        }
-        else
         if (isEndingWithDepth(p, depth))
         {
             // We found the ending quote!
             pos  = p + depth;
             break;
         }
-        quote.push_back(c);
-        col++;
+        // Fewer quotes than the depth, they are part of the content.
         p++;
     }
 
-    potentiallyRemoveEnding_WS_NL_WS(&quote);
-    xmq_implementation::removeIncidentalWhiteSpace(&quote, first_indent);
-
-    buffer->insert(buffer->end(), quote.begin(), quote.end());
+    *to = *from + potentiallyRemoveEnding_WS_NL_WS(ptr(*from), p-*from);
 }
 
-Token ParserImplementation::eatToEndOfComment()
+template<typename Actions>
+Token ParserImplementation<Actions>::eatToEndOfComment()
 {
-    assert(buf[pos] == '/');
+    assert(at(pos) == '/');
     pos++;
-    bool single_line = buf[pos] == '/';
+    bool single_line = at(pos) == '/';
     pos++;
     if (single_line)
     {
@@ -494,81 +588,72 @@ Token ParserImplementation::eatToEndOfComment()
     return t;
 }
 
-Token ParserImplementation::eatToEndOfLine()
+template<typename Actions>
+Token ParserImplementation<Actions>::eatToEndOfLine()
 {
     size_t start = pos;
-    size_t p = pos;
-    while (true)
+    auto findNewline = [](const char *b, const char *e) { return xmq_implementation::findCharOrZero(b, e, '\n'); };
+    size_t p = scan(pos, findNewline);
+    pos = p;
+    if (at(p) == '\n')
     {
-        char c = buf[p];
-        if (c == 0)
-        {
-            pos = p;
-            break;
-        }
-        if (c == '\n')
-        {
-            pos = p + 1;
-            line++;
-            col = 1;
-            break;
-        }
-        p++;
-        col++;
+        pos = p + 1;
     }
     size_t len = p-start;
-    char *value = parse_actions->allocateCopy(buf+start, len+1);
+    char *value = parse_actions->allocateCopy(ptr(start), len+1);
 
-    return Token(TokenType::text, value);
+    return Token(TokenType::text, value, len);
 }
 
-Token ParserImplementation::eatMultipleCommentLines()
+template<typename Actions>
+Token ParserImplementation<Actions>::eatMultipleCommentLines()
 {
     size_t p = pos;
 
     int first_indent = findIndent(p);
-    vector<char> buffer;
+    size_t from = p;
+    auto findStar = [](const char *b, const char *e) { return xmq_implementation::findCharOrZero(b, e, '*'); };
 
     while (true)
     {
-        char c = buf[p];
-        if (c == 0)
+        p = scan(p, findStar);
+
+        if (at(p) == 0)
         {
+            pos = p;
             error("unexpected eof in comment");
         }
-        if (c == '\n')
-        {
-            line++;
-            col = 1;
-        }
-        if (buf[p] == '*' && buf[p+1] == '/')
+        if (at(p+1) == '/')
         {
             pos = p + 2;
             break;
         }
-        buffer.push_back(c);
         p++;
-        col++;
     }
 
-    xmq_implementation::removeIncidentalWhiteSpace(&buffer, first_indent);
-    char *value = parse_actions->allocateCopy(&(buffer[0]), buffer.size()+1);
+    scratch.clear();
+    xmq_implementation::removeIncidentalWhiteSpace(ptr(from), p-from, first_indent, &scratch);
+    char *value = parse_actions->allocateCopy(scratch.data(), scratch.size()+1);
 
-    return Token(TokenType::text, value);
+    return Token(TokenType::text, value, scratch.size());
 }
 
-void ParserImplementation::parseComment(void *parent)
+template<typename Actions>
+void ParserImplementation<Actions>::parseComment(void *parent)
 {
     Token val = eatToken();
 
     parse_actions->appendComment(parent, val);
 }
 
-void ParserImplementation::parse()
+template<typename Actions>
+void ParserImplementation<Actions>::parse()
 {
     void *root_node = parse_actions->root();
     if (root != NULL && *root != 0)
     {
+        // Make sure the first word is in the window.
+        at(2*strlen(root)+2);
         if (!xmq_implementation::firstWordIs(buf, buf_len, root))
         {
             // We expect a specific root node, it does not seem to exist!
@@ -578,16 +663,24 @@ void ParserImplementation::parse()
         }
     }
 
+    top = root_node;
     parseXMQ(root_node);
 }
 
-void ParserImplementation::parseXMQ(void *parent)
+/*
+    Parse the children of parent. Nesting is tracked with an explicit stack, thus deep
+    documents do not exhaust the call stack. Parsing the children in parallel can come
+    back here, therefore only the part of the stack above its entry size is used.
+*/
+template<typename Actions>
+void ParserImplementation<Actions>::parseXMQ(void *parent)
 {
-    bool is_root = (parent == parse_actions->root());
-    int  num_contents = 0;
+    size_t bottom = open_nodes.size();
+    int  num_contents = 0; // Of the root.
 
     while (true)
     {
+        bool is_root = !is_part && parent == parse_actions->root();
         TokenType t = peekToken();
 
         if (t == TokenType::comment)
@@ -597,20 +690,30 @@ void ParserImplementation::parseXMQ(void *parent)
         else
         if (t == TokenType::text)
         {
-            if (is_root && num_contents >= 1) goto err;
-            parseNode(parent);
-            num_contents++;
+            if (is_root && num_contents++ >= 1) goto err;
+            void *node = parseNode(parent);
+            if (node == NULL) continue;
+            if (parent == top && threads > 1 && reader == NULL)
+            {
+                parseChildrenInParallel(node);
+                parseClosingBrace();
+                continue;
+            }
+            open_nodes.push_back(parent);
+            parent = node;
         }
         else
         if (t == TokenType::quote)
         {
-            if (is_root && num_contents >= 1) goto err;
+            if (is_root && num_contents++ >= 1) goto err;
             parse_actions->appendData(parent, eatToken());
-            num_contents++;
         }
         else
         {
-            break;
+            if (open_nodes.size() == bottom) break;
+            parseClosingBrace();
+            parent = open_nodes.back();
+            open_nodes.pop_back();
         }
     }
 
@@ -620,14 +723,15 @@ err:
     errornoline("multiple root nodes are not allowed unless for example: --root=config is added.");
 }
 
-void ParserImplementation::parseAttributes(void *parent)
+template<typename Actions>
+void ParserImplementation<Actions>::parseAttributes(void *parent)
 {
     Token po = eatToken();
     assert(po.type == TokenType::paren_open);
 
     while (true)
     {
-        Token t = eatToken();
+        Token t = eatToken(true);
         if (t.type == TokenType::paren_close) break;
         if (t.type != TokenType::text)
         {
@@ -660,9 +764,10 @@ void ParserImplementation::parseAttributes(void *parent)
 
 }
 
-void ParserImplementation::parseNode(void *parent)
+template<typename Actions>
+void *ParserImplementation<Actions>::parseNode(void *parent)
 {
-    Token t = eatToken();
+    Token t = eatToken(true);
     if (t.type != TokenType::text) error("expected tag");
 
     void *node = parse_actions->appendElement(parent, t);
@@ -678,18 +783,9 @@ void ParserImplementation::parseNode(void *parent)
     if (tt == TokenType::brace_open)
     {
         eatToken();
-        parseXMQ(node);
-        tt = peekToken();
-        if (tt == TokenType::brace_close)
-        {
-            eatToken();
-        }
-        else
-        {
-            error("expected closing brace");
-        }
+        return node;
     }
-    else if (tt == TokenType::equals)
+    if (tt == TokenType::equals)
     {
         eatToken();
         Token val = eatToken();
@@ -698,16 +794,135 @@ void ParserImplementation::parseNode(void *parent)
         {
             error("expected text or quote");
         }
-        if (val.value[0] != 0)
+        if (val.len != 0)
         {
             parse_actions->appendData(node, val);
         }
     }
+    return NULL;
+}
+
+template<typename Actions>
+void ParserImplementation<Actions>::parseClosingBrace()
+{
+    if (peekToken() == TokenType::brace_close)
+    {
+        eatToken();
+    }
+    else
+    {
+        error("expected closing brace");
+    }
+}
+
+template<typename Actions>
+void ParserImplementation<Actions>::parseChildrenInParallel(void *node)
+{
+    // Split the children into a few ranges per thread, at the ends of children with braces.
+    vector<size_t> splits;
+    size_t min_gap = (buf_len-pos)/(4*threads)+1;
+    if (!xmq_implementation::findChildBoundaries(buf, buf_len, pos, min_gap, &splits) ||
+        splits.size() < 2)
+    {
+        parseXMQ(node);
+        return;
+    }
+    size_t num_ranges = splits.size();
+
+    // A part has the same type as the ParseActions it was created from.
+    vector<unique_ptr<Actions>> parts;
+    for (size_t k = 0; k < num_ranges; ++k)
+    {
+        ParseActions *part = parse_actions->newPart();
+        if (part == NULL)
+        {
+            parseXMQ(node);
+            return;
+        }
+        parts.push_back(unique_ptr<Actions>(static_cast<Actions*>(part)));
+    }
+
+    atomic<size_t> next(0);
+    atomic<bool> failed(false);
+    auto worker = [&]()
+    {
+        for (;;)
+        {
+            size_t k = next++;
+            if (k >= num_ranges || failed) return;
+            // The worker sees the input up to the end of its range, with the same offsets.
+            ParserImplementation pi(parts[k].get());
+            pi.setup(parts[k].get(), file, buf, splits[k], NULL);
+            pi.pos = k == 0 ? pos : splits[k-1];
+            pi.is_part = true;
+            try
+            {
+                pi.parseXMQ(parts[k]->root());
+                // Stopping before the end of the range means that the pre-scan was mistaken.
+                if (pi.peekToken() != TokenType::none) failed = true;
+            }
+            catch (...)
+            {
+                failed = true;
+            }
+        }
+    };
+
+    vector<thread> workers;
+    for (size_t t = 1; t < min((size_t)threads, num_ranges); ++t) workers.push_back(thread(worker));
+    worker();
+    for (auto &w : workers) w.join();
+
+    if (failed)
+    {
+        // Parse again with a single thread, which reports the error exactly as usual.
+        parseXMQ(node);
+        return;
+    }
+    for (auto &part : parts)
+    {
+        parse_actions->appendPart(node, part.release());
+    }
+    pos = splits.back();
 }
 
 void xmq::parseXMQ(ParseActions *actions, const char *filename, const char *xmq, xmq::Config &config)
 {
-    ParserImplementation pi(actions);
-    pi.setup(actions, filename, xmq, config.root);
+    parseXMQ(actions, filename, xmq, strlen(xmq), config);
+}
+
+template<typename Actions>
+static void parseWith(Actions *actions, const char *filename, const char *xmq, size_t len, xmq::Config &config)
+{
+    ParserImplementation<Actions> pi(actions);
+    pi.setup(actions, filename, xmq, len, config.root);
+    pi.setThreads(config.parse_threads);
+    pi.parse();
+}
+
+template<typename Actions>
+static void parseWith(Actions *actions, const char *filename, InputReader *reader, xmq::Config &config)
+{
+    ParserImplementation<Actions> pi(actions);
+    pi.setup(actions, filename, reader, config.root);
     pi.parse();
 }
+
+void xmq::parseXMQ(ParseActions *actions, const char *filename, const char *xmq, size_t len, xmq::Config &config)
+{
+    if (auto *a = dynamic_cast<Document*>(actions)) parseWith(a, filename, xmq, len, config);
+    else if (auto *a = dynamic_cast<ParseActionsRapidXML*>(actions)) parseWith(a, filename, xmq, len, config);
+    else parseWith(actions, filename, xmq, len, config);
+}
+
+void xmq::parseXMQ(ParseActions *actions, const char *filename, InputReader *reader, xmq::Config &config)
+{
+    if (auto *a = dynamic_cast<Document*>(actions)) parseWith(a, filename, reader, config);
+    else if (auto *a = dynamic_cast<ParseActionsRapidXML*>(actions)) parseWith(a, filename, reader, config);
+    else parseWith(actions, filename, reader, config);
+}
+
+size_t ParseActionsRapidXML::NameHash::operator()(const Name &n) const
+{
+    return xmq_implementation::hashName(n.s, n.len);
+}
@@ -32,6 +32,35 @@
 using namespace std;
 using namespace xmq;
 
+// Character classes used when scanning xml.
+#define XML_WS        1 // Whitespace: space \t \r \n
+#define XML_NAME_END  2 // Ends an element or pi name: whitespace / > ? \0
+#define XML_ATTR_END  4 // Ends an attribute name: whitespace / < > = ? ! \0
+
+struct XMLCharClasses
+{
+    unsigned char c[256];
+
+    XMLCharClasses()
+    {
+        memset(c, 0, sizeof(c));
+        const unsigned char *ws = (const unsigned char*)" \t\r\n";
+        for (; *ws; ++ws) c[*ws] |= XML_WS | XML_NAME_END | XML_ATTR_END;
+        c[0] |= XML_NAME_END | XML_ATTR_END;
+        const unsigned char *ne = (const unsigned char*)"/>?";
+        for (; *ne; ++ne) c[*ne] |= XML_NAME_END;
+        const unsigned char *ae = (const unsigned char*)"/<>=?!";
+        for (; *ae; ++ae) c[*ae] |= XML_ATTR_END;
+    }
+};
+
+static const XMLCharClasses xml_char_classes;
+
+static inline bool is(char c, unsigned char cls)
+{
+    return xml_char_classes.c[(unsigned char)c] & cls;
+}
+
 class XMLHTMLParserImplementation
 {
 public:
@@ -40,57 +69,52 @@ public:
 private:
     ParseActions *parse_actions {};
     bool html {};
+    bool preserve_ws {};
     const char *file {};
     const char *buf {};
-    const char *root {};
     size_t buf_len {};
     size_t pos {};
-    int line {};
-    int col {};
+    bool refer_to_input {}; // Text found as it is in the input is passed on as a slice of the input.
+
+    vector<void*> open_nodes; // The parents of the elements that have not yet been closed.
+    vector<char> scratch;     // Text with translated entities.
 
-    int ws_start {};
     void eatWhiteSpace();
 
     void error(const char* fmt, ...);
-    void errornoline(const char* fmt, ...);
-
-    int findIndent(int p);
-
-    bool isReservedCharacter(char c);
 
     NodeType peekNodeToken();
-    NodeToken eatNodeToken();
-    NodeToken eatToEndOfComment();
-    NodeToken eatToEndOfLine();
-    NodeToken eatMultipleCommentLines();
-    NodeToken eatToEndOfText();
-    void eatToEndOfQuote(int indent, vector<char> *buffer);
-    NodeToken eatToEndOfQuotes(int indent);
+
+    Token copy(size_t from, size_t to);
+    Token copyName(size_t from, size_t to);
+    Token copyScratch();
+    size_t eatEscapedText(size_t p, char stop, bool *translated);
+    size_t translateEntity(size_t p);
+    size_t findEnd(size_t p, const char *end);
+    bool isVoidElement(const char *name, size_t len);
 
     // Syntax
+    void *parseElement(void *parent);
+    void parseAttributes(void *node);
+    void parseCloseTag();
+    void parseText(void *parent, size_t contents_start);
     void parseComment(void *parent);
-    void parseNode(void *parent);
-    void parseAttributes(void *parent);
-
-    size_t findDepth(size_t p, int *depth);
-    bool isEndingWithDepth(size_t p, int depth);
-    size_t potentiallySkipLeading_WS_NL_WS(size_t p);
-    void potentiallyRemoveEnding_WS_NL_WS(vector<char> *buffer);
-    void trimTokenWhiteSpace(NodeToken *t);
-
-    void padWithSingleSpaces(NodeToken *t);
+    void parseCData(void *parent);
+    void parsePI(void *parent);
+    void parseDocType(void *parent);
+    void skipDeclaration();
 
 public:
-    void setup(ParseActions *a, const char *f, const char *b, const char *r)
+    void setup(ParseActions *a, const char *f, const char *b, size_t len, xmq::Config &config)
     {
         parse_actions = a;
         file = f;
         buf = b;
-        buf_len = strlen(buf);
-        root = r;
+        buf_len = len;
+        html = config.tree_type == TreeType::html;
+        preserve_ws = config.preserve_ws;
         pos = 0;
-        line = 1;
-        col = 1;
+        refer_to_input = a->referToInput();
     }
     void parseXML(void *node);
     void parse();
@@ -98,81 +122,457 @@ public:
 
 void XMLHTMLParserImplementation::error(const char* fmt, ...)
 {
-    printf("%s:%d:%d: error: ", file, line, col);
+    // Line and column are only needed now, so find them now.
+    int line, col;
+    xmq_implementation::NewlineIndex(buf, buf_len).lookup(pos, &line, &col);
+    const char *from = xmq_implementation::findStartingNewline(buf+pos, buf);
+    const char *to = xmq_implementation::findEndingNewline(buf+pos);
+
     va_list args;
     va_start(args, fmt);
-    vprintf(fmt, args);
+    string msg = xmq_implementation::errorMessage(file, line, col, fmt, args);
     va_end(args);
-    printf("\n");
 
-    printf("%.*s\n", col, &buf[pos-col+1]);
-    exit(1);
+    msg += string(from, to)+"\n";
+    msg += string(col-1, ' ');
+    msg += "^\n";
+    throw xmq::Error(msg);
 }
 
-void XMLHTMLParserImplementation::errornoline(const char* fmt, ...)
+void XMLHTMLParserImplementation::eatWhiteSpace()
 {
-    printf("%s:%d:%d: error: ", file, line, col);
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-    printf("\n");
+    while (is(buf[pos], XML_WS)) pos++;
+}
+
+NodeType XMLHTMLParserImplementation::peekNodeToken()
+{
+    if (pos >= buf_len) return NodeType::none;
 
-    exit(1);
+    const char *s = buf+pos;
+    if (s[0] == 0) return NodeType::none;
+    if (s[0] != '<') return NodeType::text;
+
+    switch (s[1])
+    {
+    case '/':
+        return NodeType::close;
+    case '?':
+        if ((s[2] == 'x' || s[2] == 'X') &&
+            (s[3] == 'm' || s[3] == 'M') &&
+            (s[4] == 'l' || s[4] == 'L') &&
+            is(s[5], XML_WS))
+        {
+            return NodeType::declaration;
+        }
+        return NodeType::pi;
+    case '!':
+        if (s[2] == '-' && s[3] == '-')
+        {
+            return NodeType::comment;
+        }
+        if (!strncmp(s+2, "[CDATA[", 7))
+        {
+            return NodeType::cdata;
+        }
+        if ((html ? !strncasecmp(s+2, "DOCTYPE", 7) : !strncmp(s+2, "DOCTYPE", 7)) &&
+            is(s[9], XML_WS))
+        {
+            return NodeType::doctype;
+        }
+        // Other markup declarations, <!ELEMENT <!ENTITY etc.
+        return NodeType::declaration;
+    }
+    return NodeType::open;
 }
 
-void XMLHTMLParserImplementation::eatWhiteSpace()
+Token XMLHTMLParserImplementation::copy(size_t from, size_t to)
+{
+    if (refer_to_input) return Token(TokenType::text, buf+from, to-from);
+    // The character at to is replaced with the terminating zero in the copy.
+    return Token(TokenType::text, parse_actions->allocateCopy(buf+from, to-from+1), to-from);
+}
+
+Token XMLHTMLParserImplementation::copyName(size_t from, size_t to)
+{
+    if (refer_to_input) return Token(TokenType::text, buf+from, to-from);
+    return Token(TokenType::text, parse_actions->allocateName(buf+from, to-from+1), to-from);
+}
+
+Token XMLHTMLParserImplementation::copyScratch()
+{
+    scratch.push_back(0);
+    return Token(TokenType::text, parse_actions->allocateCopy(&scratch[0], scratch.size()), scratch.size()-1);
+}
+
+size_t XMLHTMLParserImplementation::findEnd(size_t p, const char *end)
+{
+    size_t n = strlen(end);
+    while (p < buf_len)
+    {
+        const char *f = (const char*)memchr(buf+p, end[0], buf_len-p);
+        if (f == NULL) break;
+        p = f-buf;
+        if (!strncmp(f, end, n)) return p;
+        p++;
+    }
+    pos = buf_len;
+    error("unexpected end of data");
+    return 0;
+}
+
+size_t XMLHTMLParserImplementation::eatEscapedText(size_t p, char stop, bool *translated)
+{
+    size_t start = p;
+    const char *end = (const char*)memchr(buf+p, stop, buf_len-p);
+    size_t stop_at = end ? end-buf : buf_len;
+    const char *amp = (const char*)memchr(buf+p, '&', stop_at-p);
+    if (amp == NULL)
+    {
+        *translated = false;
+        return stop_at;
+    }
+
+    // There are entities to translate.
+    p = amp-buf;
+    scratch.assign(buf+start, buf+p);
+    while (p < stop_at)
+    {
+        if (buf[p] == '&')
+        {
+            p = translateEntity(p);
+            continue;
+        }
+        scratch.push_back(buf[p]);
+        p++;
+    }
+    *translated = true;
+    return stop_at;
+}
+
+size_t XMLHTMLParserImplementation::translateEntity(size_t p)
+{
+    const char *s = buf+p;
+    assert(s[0] == '&');
+
+    if (!strncmp(s, "&amp;", 5)) { scratch.push_back('&'); return p+5; }
+    if (!strncmp(s, "&lt;", 4)) { scratch.push_back('<'); return p+4; }
+    if (!strncmp(s, "&gt;", 4)) { scratch.push_back('>'); return p+4; }
+    if (!strncmp(s, "&quot;", 6)) { scratch.push_back('"'); return p+6; }
+    if (!strncmp(s, "&apos;", 6)) { scratch.push_back('\''); return p+6; }
+    if (s[1] != '#')
+    {
+        // Not a known entity, keep the & as is.
+        scratch.push_back('&');
+        return p+1;
+    }
+
+    // A code beyond the last code point stops growing, thus it can not overflow.
+    unsigned long code = 0;
+    unsigned long base = 10;
+    size_t i = 2;
+    if (s[2] == 'x')
+    {
+        base = 16;
+        i = 3;
+    }
+    size_t first_digit = i;
+    for (;; ++i)
+    {
+        char c = s[i];
+        unsigned long d;
+        if (c >= '0' && c <= '9') d = c-'0';
+        else if (base == 16 && c >= 'a' && c <= 'f') d = c-'a'+10;
+        else if (base == 16 && c >= 'A' && c <= 'F') d = c-'A'+10;
+        else break;
+        if (code <= 0x10FFFF) code = code*base + d;
+    }
+    if (s[i] != ';')
+    {
+        pos = p+i;
+        error("expected ;");
+    }
+    // Zero, the surrogates and codes beyond the last code point are not characters.
+    if (i == first_digit || code == 0 || (code >= 0xD800 && code <= 0xDFFF) || code > 0x10FFFF)
+    {
+        pos = p;
+        error("invalid numeric character entity");
+    }
+
+    // Insert the code point as utf8.
+    if (code < 0x80)
+    {
+        scratch.push_back(code);
+    }
+    else if (code < 0x800)
+    {
+        scratch.push_back(0xC0 | (code >> 6));
+        scratch.push_back(0x80 | (code & 0x3F));
+    }
+    else if (code < 0x10000)
+    {
+        scratch.push_back(0xE0 | (code >> 12));
+        scratch.push_back(0x80 | ((code >> 6) & 0x3F));
+        scratch.push_back(0x80 | (code & 0x3F));
+    }
+    else
+    {
+        scratch.push_back(0xF0 | (code >> 18));
+        scratch.push_back(0x80 | ((code >> 12) & 0x3F));
+        scratch.push_back(0x80 | ((code >> 6) & 0x3F));
+        scratch.push_back(0x80 | (code & 0x3F));
+    }
+    return p+i+1;
+}
+
+bool XMLHTMLParserImplementation::isVoidElement(const char *name, size_t len)
 {
-    ws_start = pos;
-    while (true)
+    static const char *voids[] =
+        { "area", "base", "br", "col", "command", "embed", "hr", "img", "input",
+          "keygen", "link", "meta", "param", "source", "track", "wbr", NULL };
+
+    for (const char **v = voids; *v != NULL; ++v)
     {
-        char c = buf[pos];
-        if (c == 0) break;
-        else if (xmq_implementation::isNewLine(c))
+        if (strlen(*v) == len && !strncasecmp(*v, name, len)) return true;
+    }
+    return false;
+}
+
+void *XMLHTMLParserImplementation::parseElement(void *parent)
+{
+    assert(buf[pos] == '<');
+    pos++;
+    size_t name_start = pos;
+    while (!is(buf[pos], XML_NAME_END)) pos++;
+    if (pos == name_start) error("expected element name");
+    size_t name_end = pos;
+
+    void *node = parse_actions->appendElement(parent, copyName(name_start, name_end));
+
+    eatWhiteSpace();
+    parseAttributes(node);
+
+    if (buf[pos] == '>')
+    {
+        pos++;
+        if (html && isVoidElement(buf+name_start, name_end-name_start))
         {
-            col = 1;
-            line++;
+            // Void elements have no content and no closing tag.
+            return NULL;
         }
-        else if (!xmq_implementation::isWhiteSpace(c)) break;
+        return node;
+    }
+    if (buf[pos] == '/')
+    {
+        pos++;
+        if (buf[pos] != '>') error("expected >");
         pos++;
-        col++;
+        return NULL;
     }
+    error("expected >");
+    return NULL;
 }
 
-NodeType XMLHTMLParserImplementation::peekNodeToken()
+void XMLHTMLParserImplementation::parseAttributes(void *node)
+{
+    while (!is(buf[pos], XML_ATTR_END))
+    {
+        size_t name_start = pos;
+        pos++;
+        while (!is(buf[pos], XML_ATTR_END)) pos++;
+        Token key = copyName(name_start, pos);
+
+        eatWhiteSpace();
+        if (buf[pos] != '=')
+        {
+            // Html permits attributes without values, like: <input required>
+            if (!html) error("expected =");
+            parse_actions->appendAttribute(node, key, key);
+            eatWhiteSpace();
+            continue;
+        }
+        pos++;
+        eatWhiteSpace();
+
+        char quote = buf[pos];
+        if (quote != '\'' && quote != '"') error("expected ' or \"");
+        pos++;
+
+        bool translated;
+        size_t value_start = pos;
+        size_t value_end = eatEscapedText(pos, quote, &translated);
+        pos = value_end;
+        if (buf[pos] != quote) error("expected ' or \"");
+        Token value = translated ? copyScratch() : copy(value_start, value_end);
+        pos++;
+
+        parse_actions->appendAttribute(node, key, value);
+        eatWhiteSpace();
+    }
+}
+
+void XMLHTMLParserImplementation::parseCloseTag()
 {
+    assert(buf[pos] == '<' && buf[pos+1] == '/');
+    pos += 2;
+    // The closing name is not checked against the opening name.
+    while (!is(buf[pos], XML_NAME_END)) pos++;
     eatWhiteSpace();
+    if (buf[pos] != '>') error("expected >");
+    pos++;
+}
 
-    char c = buf[pos];
+void XMLHTMLParserImplementation::parseText(void *parent, size_t contents_start)
+{
+    // Leading whitespace has already been skipped, back up if it should be preserved.
+    if (preserve_ws) pos = contents_start;
 
-    if (c == 0) return NodeType::none;
-    if (c == '<')
+    bool translated;
+    size_t start = pos;
+    size_t end = eatEscapedText(pos, '<', &translated);
+    pos = end;
+
+    if (translated)
     {
-        char cc = buf[pos+1];
-        if (cc == '?')
+        if (!preserve_ws)
         {
-            return NodeType::pi;
+            while (scratch.size() > 0 && is(scratch.back(), XML_WS)) scratch.pop_back();
         }
-        if (cc == '!')
+        parse_actions->appendData(parent, copyScratch());
+        return;
+    }
+    if (!preserve_ws)
+    {
+        while (end > start && is(buf[end-1], XML_WS)) end--;
+    }
+    parse_actions->appendData(parent, copy(start, end));
+}
+
+void XMLHTMLParserImplementation::parseComment(void *parent)
+{
+    pos += 4; // Skip <!--
+    size_t end = findEnd(pos, "-->");
+    parse_actions->appendComment(parent, copy(pos, end));
+    pos = end+3;
+}
+
+void XMLHTMLParserImplementation::parseCData(void *parent)
+{
+    pos += 9; // Skip <![CDATA[
+    size_t end = findEnd(pos, "]]>");
+    parse_actions->appendCData(parent, copy(pos, end));
+    pos = end+3;
+}
+
+void XMLHTMLParserImplementation::parsePI(void *parent)
+{
+    pos += 2; // Skip <?
+    size_t name_start = pos;
+    while (!is(buf[pos], XML_NAME_END)) pos++;
+    if (pos == name_start) error("expected PI target");
+    Token name = copy(name_start, pos);
+    eatWhiteSpace();
+    size_t end = findEnd(pos, "?>");
+    parse_actions->appendPI(parent, name, copy(pos, end));
+    pos = end+2;
+}
+
+void XMLHTMLParserImplementation::parseDocType(void *parent)
+{
+    pos += 10; // Skip <!DOCTYPE and the whitespace.
+    size_t start = pos;
+    while (buf[pos] != '>')
+    {
+        if (pos >= buf_len || buf[pos] == 0) error("unexpected end of data");
+        if (buf[pos] == '[')
         {
-            char ccc = buf[pos+1];
-            if (ccc == '-')
+            // Skip the internal subset, brackets can nest.
+            pos++;
+            int depth = 1;
+            while (depth > 0)
             {
-                return NodeType::comment;
+                if (pos >= buf_len || buf[pos] == 0) error("unexpected end of data");
+                if (buf[pos] == '[') depth++;
+                if (buf[pos] == ']') depth--;
+                pos++;
             }
-            return NodeType::doctype;
-        }
-        if (cc == '-')
-        {
-            return NodeType::comment;
+            continue;
         }
+        pos++;
+    }
+    parse_actions->appendDocType(parent, copy(start, pos));
+    pos++;
+}
+
+void XMLHTMLParserImplementation::skipDeclaration()
+{
+    // The xml declaration <?xml ... ?> and the markup declarations <!ELEMENT ...> <!ENTITY ...>
+    // do not become nodes.
+    if (buf[pos+1] == '?')
+    {
+        pos = findEnd(pos, "?>")+2;
+    }
+    else
+    {
+        pos = findEnd(pos, ">")+1;
     }
-    return NodeType::none;
 }
 
-void XMLHTMLParserImplementation::parseXML(void *node)
+void XMLHTMLParserImplementation::parseXML(void *root)
 {
+    void *parent = root;
+    open_nodes.clear();
 
+    // Skip the utf8 byte order mark.
+    if (buf_len >= 3 && !strncmp(buf, "\xEF\xBB\xBF", 3)) pos = 3;
+
+    // Nesting is tracked with an explicit stack, deep documents do not exhaust the call stack.
+    for (;;)
+    {
+        size_t contents_start = pos;
+        eatWhiteSpace();
+        NodeType nt = peekNodeToken();
+        switch (nt)
+        {
+        case NodeType::none:
+            if (parent != root) error("unexpected end of data");
+            return;
+        case NodeType::text:
+            if (parent == root) error("expected <");
+            parseText(parent, contents_start);
+            break;
+        case NodeType::open:
+        {
+            void *node = parseElement(parent);
+            if (node != NULL)
+            {
+                open_nodes.push_back(parent);
+                parent = node;
+            }
+            break;
+        }
+        case NodeType::close:
+            if (parent == root) error("unexpected closing tag");
+            parseCloseTag();
+            parent = open_nodes.back();
+            open_nodes.pop_back();
+            break;
+        case NodeType::comment:
+            parseComment(parent);
+            break;
+        case NodeType::cdata:
+            parseCData(parent);
+            break;
+        case NodeType::pi:
+            parsePI(parent);
+            break;
+        case NodeType::doctype:
+            parseDocType(parent);
+            break;
+        case NodeType::declaration:
+            skipDeclaration();
+            break;
+        }
+    }
 }
 
 void XMLHTMLParserImplementation::parse()
@@ -181,8 +581,13 @@ void XMLHTMLParserImplementation::parse()
 }
 
 void xmq::parseXML(ParseActions *actions, const char *filename, const char *xml, xmq::Config &config)
+{
+    parseXML(actions, filename, xml, strlen(xml), config);
+}
+
+void xmq::parseXML(ParseActions *actions, const char *filename, const char *xml, size_t len, xmq::Config &config)
 {
     XMLHTMLParserImplementation pi(actions);
-    pi.setup(actions, filename, xml, config.root);
+    pi.setup(actions, filename, xml, len, config);
     pi.parse();
 }
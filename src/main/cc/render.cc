@@ -27,36 +27,49 @@
 
 #include "xmq.h"
 #include "xmq_implementation.h"
+#include "xmq_rapidxml.h"
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 
+/*
+    The renderer is instantiated for the concrete RenderActions of the built in backends,
+    thus the compiler can inline the calls to them. Other RenderActions are rendered
+    through the virtual functions of xmq::RenderActions.
+*/
+template<typename Actions>
 struct RenderImplementation
 {
-    RenderImplementation(xmq::RenderActions *ra,
+    RenderImplementation(Actions *ra,
                          xmq::RenderType rt,
                          bool use_color,
-                         std::vector<char> *out,
-                         xmq::Config &s) : out_buffer(out), render_type_(rt), use_color_(use_color), actions(ra), settings(s) {}
+                         xmq::OutputWriter *writer,
+                         xmq::Config &s) :
+        out(writer, rt == xmq::RenderType::html ? xmq_implementation::Escape::html : xmq_implementation::Escape::none),
+        render_type_(rt), use_color_(use_color), actions(ra), settings(s), excludes(s.excludes) {}
     void render();
 
-    std::vector<char> *out_buffer;
+    xmq_implementation::OutputSink out;
     xmq::RenderType render_type_ {};
     bool use_color_ {};
-    const char *element_name_color; // blue
-    const char *element_name_sugar_color; // green
-    const char *attribute_name_sugar_color; // green
-    const char *comment_color; // yellow
-    const char *data_color; // red
-    const char *reset_color;
-    xmq::RenderActions *actions {};
+    const char *element_name_color {}; // blue
+    const char *element_name_sugar_color {}; // green
+    const char *attribute_name_sugar_color {}; // green
+    const char *comment_color {}; // yellow
+    const char *data_color {}; // red
+    const char *reset_color {};
+    Actions *actions {};
     xmq::Config settings;
+    xmq_implementation::ExcludeMatcher excludes;
 
 
-    int output(const char* fmt, ...);
-    int outputNoEscape(const char* fmt, ...);
+    void useColors();
     void useAnsiColors();
     void useHtmlColors();
-    bool escapeHtml(char c, string *escape);
     void renderElementName(xmq::str name);
     void renderElementNameSugar(xmq::str tag);
     void renderElementNameSugarPI(xmq::str tag);
@@ -67,6 +80,11 @@ struct RenderImplementation
     size_t trimWhiteSpace(xmq::str *v);
     void printComment(xmq::str comment, int indent);
     void printEscaped(xmq::str value, bool is_attribute, int indent, bool must_quote);
+    // Iterate over the children that are not excluded.
+    void *firstChild(void *node) { return skipExcluded(actions->firstNode(node)); }
+    void *nextChild(void *node) { return skipExcluded(actions->nextSibling(node)); }
+    void *skipExcluded(void *node);
+    bool isExcludedAttribute(xmq::str node_name, void *attr);
     bool nodeHasNoChildren(void *node);
     bool nodeHasSingleDataChild(void *node, xmq::str *data);
     void printAlign(int i);
@@ -81,12 +99,52 @@ struct RenderImplementation
                       int indent,
                       int align,
                       bool do_indent);
+    // Add the node as a line to the run, unless it is rendered with its own children.
+    bool addNodeLine(void *i, int indent, vector<pair<void*,xmq::str>> *lines, size_t *align);
     void renderNode(void *i, int indent, bool newline, vector<pair<void*,xmq::str>> *lines, size_t *align);
+    // Print the accumulated key = value lines with proper alignment, then start a new run.
+    void flushLines(vector<pair<void*,xmq::str>> *lines, int indent, size_t *align);
+    // Add a line to the run, a run that reaches the align limit is flushed.
+    void addLine(void *i, xmq::str value, bool align_key, int indent, vector<pair<void*,xmq::str>> *lines, size_t *align);
     void renderWithChildren(void *node, int indent, bool newline = true);
+    // Print the name and attributes of a node rendered with its children, up to the {.
+    void startBlock(void *node, int indent, bool newline);
+    // True if renderNode renders the node with renderWithChildren.
+    bool isRenderedWithChildren(void *node);
+    // True for elements, false for data, comments, cdata, pis, doctypes and declarations.
+    bool isElement(void *node);
+    // Returns false, having rendered nothing, when the children are too few to split.
+    bool renderChildrenInParallel(void *node, int indent);
+
+    // The blocks that renderWithChildren has started but not yet ended.
+    struct Block
+    {
+        void *next; // The next child to render.
+        int indent;
+    };
+    vector<Block> blocks_;
+    // The run of key = value lines. The run of a block is flushed before a child block
+    // starts, thus the blocks can share it.
+    vector<pair<void*,xmq::str>> lines_;
 };
 
 
-void RenderImplementation::useAnsiColors()
+template<typename Actions>
+void RenderImplementation<Actions>::useColors()
+{
+    if (!use_color_) return;
+    if (render_type_ == xmq::RenderType::terminal)
+    {
+        useAnsiColors();
+    }
+    if (render_type_ == xmq::RenderType::html)
+    {
+        useHtmlColors();
+    }
+}
+
+template<typename Actions>
+void RenderImplementation<Actions>::useAnsiColors()
 {
     element_name_color = "\033[0;34m";
     element_name_sugar_color = "\033[0;32m";
@@ -96,7 +154,8 @@ void RenderImplementation::useAnsiColors()
     reset_color = "\033[0m";
 }
 
-void RenderImplementation::useHtmlColors()
+template<typename Actions>
+void RenderImplementation<Actions>::useHtmlColors()
 {
     element_name_color = "<span style=\"color:#000088\">";
     element_name_sugar_color = "<span style=\"color:#00aa00\">";
@@ -106,86 +165,73 @@ void RenderImplementation::useHtmlColors()
     reset_color = "</span>";
 }
 
-bool RenderImplementation::escapeHtml(char c, string *escape)
-{
-    if (c  == '&')
-    {
-        *escape = "&amp;";
-        return true;
-    }
-    if (c  == '<')
-    {
-        *escape = "&lt;";
-        return true;
-    }
-    if (c  == '>')
-    {
-        *escape = "&gt;";
-        return true;
-    }
-    return false;
-}
-
-void RenderImplementation::renderElementName(xmq::str name)
+template<typename Actions>
+void RenderImplementation<Actions>::renderElementName(xmq::str name)
 {
-    if (use_color_) outputNoEscape(element_name_color);
-    output("%.*s", name.l, name.s);
-    if (use_color_) outputNoEscape(reset_color);
+    if (use_color_) out.putRaw(element_name_color);
+    out.put(name);
+    if (use_color_) out.putRaw(reset_color);
 }
 
-void RenderImplementation::renderElementNameSugar(xmq::str tag)
+template<typename Actions>
+void RenderImplementation<Actions>::renderElementNameSugar(xmq::str tag)
 {
-    if (use_color_) outputNoEscape(element_name_sugar_color);
-    output("%.*s", tag.l, tag.s);
-    if (use_color_) outputNoEscape(reset_color);
+    if (use_color_) out.putRaw(element_name_sugar_color);
+    out.put(tag);
+    if (use_color_) out.putRaw(reset_color);
 }
 
-void RenderImplementation::renderElementNameSugarPI(xmq::str tag)
+template<typename Actions>
+void RenderImplementation<Actions>::renderElementNameSugarPI(xmq::str tag)
 {
-    if (use_color_) outputNoEscape(element_name_sugar_color);
-    output("?%.*s", tag.l, tag.s);
-    if (use_color_) outputNoEscape(reset_color);
+    if (use_color_) out.putRaw(element_name_sugar_color);
+    out.put('?');
+    out.put(tag);
+    if (use_color_) out.putRaw(reset_color);
 }
 
-void RenderImplementation::renderElementNameSugarDT()
+template<typename Actions>
+void RenderImplementation<Actions>::renderElementNameSugarDT()
 {
-    if (use_color_) outputNoEscape(element_name_sugar_color);
-    output("!DOCTYPE");
-    if (use_color_) outputNoEscape(reset_color);
+    if (use_color_) out.putRaw(element_name_sugar_color);
+    out.put("!DOCTYPE");
+    if (use_color_) out.putRaw(reset_color);
 }
 
-void RenderImplementation::printAttributeKey(xmq::str key)
+template<typename Actions>
+void RenderImplementation<Actions>::printAttributeKey(xmq::str key)
 {
-    if (use_color_) outputNoEscape(attribute_name_sugar_color);
-    output("%.*s", key.l, key.s);
-    if (use_color_) outputNoEscape(reset_color);
+    if (use_color_) out.putRaw(attribute_name_sugar_color);
+    out.put(key);
+    if (use_color_) out.putRaw(reset_color);
 }
 
-bool RenderImplementation::containsNewlines(xmq::str value)
+template<typename Actions>
+bool RenderImplementation<Actions>::containsNewlines(xmq::str value)
 {
     if (value.l == 0) return false;
     const char *s = value.s;
     const char *end = s+value.l;
     while (s < end)
     {
-        if (*s == '\n') return true;
-        if (*s == '\r') return true;
+        if (xmq_implementation::hasCharClass(*s, xmq_implementation::line_break)) return true;
         s++;
     }
     return false;
 }
 
-void RenderImplementation::printIndent(int i, bool newline)
+template<typename Actions>
+void RenderImplementation<Actions>::printIndent(int i, bool newline)
 {
-    if (newline) output("\n");
-    while (--i >= 0) output(" ");
+    if (newline) out.put('\n');
+    out.putRepeat(' ', i);
 }
 
-size_t RenderImplementation::trimWhiteSpace(xmq::str *v)
+template<typename Actions>
+size_t RenderImplementation<Actions>::trimWhiteSpace(xmq::str *v)
 {
     const char *data = v->s;
     size_t len = v->l;
-    if (len == 0) len = strlen(v->s)+1;
 
     // Trim away whitespace at the beginning.
     while (len > 0 && *data != 0)
@@ -206,7 +252,8 @@ size_t RenderImplementation::trimWhiteSpace(xmq::str *v)
     return len;
 }
 
-void RenderImplementation::printComment(xmq::str comment, int indent)
+template<typename Actions>
+void RenderImplementation<Actions>::printComment(xmq::str comment, int indent)
 {
     const char *c = comment.s;
     size_t len = comment.l;
@@ -218,9 +265,10 @@ void RenderImplementation::printComment(xmq::str comment, int indent)
     }
     if (single_line)
     {
-        if (use_color_) outputNoEscape(comment_color);
-        output("// %.*s", len, c);
-        if (use_color_) outputNoEscape(reset_color);
+        if (use_color_) out.putRaw(comment_color);
+        out.put("// ");
+        out.put(c, len);
+        if (use_color_) out.putRaw(reset_color);
         return;
     }
     const char *p = c;
@@ -232,26 +280,30 @@ void RenderImplementation::printComment(xmq::str comment, int indent)
             int n = i - prev_i;
             if (p == c)
             {
-                if (use_color_) outputNoEscape(comment_color);
-                output("/* %.*s", n, p);
+                if (use_color_) out.putRaw(comment_color);
+                out.put("/* ");
+                out.put(p, n);
             }
             else if (i == len-1)
             {
                 printIndent(indent);
                 xmq::str pp(p, n);
                 int nn = trimWhiteSpace(&pp);
-                if (use_color_) outputNoEscape(comment_color);
-                output("   %.*s */", (int)nn, pp);
+                if (use_color_) out.putRaw(comment_color);
+                out.putRepeat(' ', 3);
+                out.put(pp.s, nn);
+                out.put(" */");
             }
             else
             {
                 printIndent(indent);
                 xmq::str pp(p, n);
                 size_t nn = trimWhiteSpace(&pp);
-                if (use_color_) outputNoEscape(comment_color);
-                output("   %.*s", (int)nn, pp);
+                if (use_color_) out.putRaw(comment_color);
+                out.putRepeat(' ', 3);
+                out.put(pp.s, nn);
             }
-            if (use_color_) outputNoEscape(reset_color);
+            if (use_color_) out.putRaw(reset_color);
             p = c+i+1;
             prev_i = i+1;
         }
@@ -259,7 +311,8 @@ void RenderImplementation::printComment(xmq::str comment, int indent)
 
 }
 
-void RenderImplementation::printEscaped(xmq::str value, bool is_attribute, int indent, bool must_quote)
+template<typename Actions>
+void RenderImplementation<Actions>::printEscaped(xmq::str value, bool is_attribute, int indent, bool must_quote)
 {
     const char *s = value.s;
     const char *end = s+value.l;
@@ -289,77 +342,104 @@ void RenderImplementation::printEscaped(xmq::str value, bool is_attribute, int i
     {
         // There are no single quotes inside the content s.
         // We can safely print it.
-        if (use_color_) outputNoEscape(data_color);
-        output("%.*s", value.l, value.s);
-        if (use_color_) outputNoEscape(reset_color);
+        if (use_color_) out.putRaw(data_color);
+        out.put(value);
+        if (use_color_) out.putRaw(reset_color);
     }
     else
     {
         size_t n = 0;
-        if (use_color_) outputNoEscape(data_color);
-        for (int i=0; i<escape_depth; ++i)
-        {
-            output("'");
-        }
+        if (use_color_) out.putRaw(data_color);
+        out.putRepeat('\'', escape_depth);
         if (add_start_newline)
         {
             printIndent(indent+escape_depth);
         }
         while (s < end)
         {
-            switch (*s) {
-                case '\n' :
-                    printIndent(indent+escape_depth);
-                    n = 0;
-                    if (use_color_) outputNoEscape(data_color);
-                    break;
-                default:    output("%c", *s);
+            if (*s == '\n')
+            {
+                printIndent(indent+escape_depth);
+                if (use_color_) out.putRaw(data_color);
+                s++;
+                n = 1;
+            }
+            else
+            {
+                // Copy everything up to the next newline in one go,
+                // but stop where a long attribute line has to be broken.
+                const char *stop = (const char*)memchr(s, '\n', end-s);
+                if (stop == NULL) stop = end;
+                if (is_attribute && (size_t)(stop-s) > 81-n) stop = s+81-n;
+                out.put(s, stop-s);
+                n += stop-s;
+                s = stop;
             }
-            s++;
-            n++;
             if (is_attribute && n > 80)
             {
                 n = 0;
-                output("'");
+                out.put('\'');
                 printIndent(indent);
-                if (use_color_) outputNoEscape(data_color);
-                output("'");
+                if (use_color_) out.putRaw(data_color);
+                out.put('\'');
             }
         }
         if (add_end_newline)
         {
             printIndent(indent+escape_depth);
         }
-        for (int i=0; i<escape_depth; ++i)
-        {
-            output("'");
-        }
-        if (use_color_) outputNoEscape(reset_color);
+        out.putRepeat('\'', escape_depth);
+        if (use_color_) out.putRaw(reset_color);
     }
 }
 
 /*
     Test if the node has no children.
 */
-bool RenderImplementation::nodeHasNoChildren(void *node)
+template<typename Actions>
+bool RenderImplementation<Actions>::nodeHasNoChildren(void *node)
+{
+    return firstChild(node) == NULL;
+}
+
+template<typename Actions>
+void *RenderImplementation<Actions>::skipExcluded(void *node)
+{
+    if (!excludes.hasElementRules()) return node;
+    while (node != NULL && isElement(node))
+    {
+        xmq::str name;
+        actions->loadName(node, &name);
+        if (!excludes.excludeElement(name)) break;
+        node = actions->nextSibling(node);
+    }
+    return node;
+}
+
+template<typename Actions>
+bool RenderImplementation<Actions>::isExcludedAttribute(xmq::str node_name, void *attr)
 {
-    return actions->firstNode(node) == NULL;
+    if (!excludes.hasAttributeRules()) return false;
+    xmq::str key;
+    actions->loadName(attr, &key);
+    return excludes.excludeAttribute(node_name, key);
 }
 
 /*
     Test if the node has a single data child.
     Such nodes should be rendered as node = data
 */
-bool RenderImplementation::nodeHasSingleDataChild(void *node,
+template<typename Actions>
+bool RenderImplementation<Actions>::nodeHasSingleDataChild(void *node,
                                                   xmq::str *data)
 {
     data->s = "";
     data->l = 0;
-    void *i = actions->firstNode(node);
+    void *i = firstChild(node);
 
     if (i != NULL &&
-        actions->isNodeData(i) &&
-        actions->nextSibling(i) == NULL)
+        actions->nodeKind(i) == xmq::NodeType::text &&
+        nextChild(i) == NULL)
     {
         actions->loadValue(i, data);
         return true;
@@ -368,12 +448,14 @@ bool RenderImplementation::nodeHasSingleDataChild(void *node,
     return false;
 }
 
-void RenderImplementation::printAlign(int i)
+template<typename Actions>
+void RenderImplementation<Actions>::printAlign(int i)
 {
-    while (--i >= 0) output(" ");
+    out.putRepeat(' ', i);
 }
 
-void RenderImplementation::printAttributes(void *node,
+template<typename Actions>
+void RenderImplementation<Actions>::printAttributes(void *node,
                                            int indent)
 {
     if (!actions->hasAttributes(node)) return;
@@ -383,85 +465,77 @@ void RenderImplementation::printAttributes(void *node,
     actions->loadName(node, &node_name);
 
     void *i = actions->firstAttribute(node);
-
     while (i)
     {
-        /*
-        string key = string(i->name(), i->name_size());
-        string checka = string("@")+key;
-        string checkb = string(node->name())+"@"+key;
-        if (settings_->excludes.count(checka) == 0 &&
-            settings_->excludes.count(checkb) == 0)
-            {*/
-        xmq::str name;
-        actions->loadName(i, &name);
-        if (name.l > align)
+        if (!isExcludedAttribute(node_name, i))
         {
-            align = name.l;
+            xmq::str name;
+            actions->loadName(i, &name);
+            if (name.l > align)
+            {
+                align = name.l;
+            }
         }
         i = actions->nextAttribute(i);
     }
 
-    output("(");
+    out.put('(');
     bool do_indent = false;
 
     i = actions->firstAttribute(node);
     while (i)
     {
-        xmq::str key;
-        actions->loadName(i, &key);
-        xmq::str value;
-        actions->loadValue(i, &value);
-
-        string checka = string("@")+key.to_str();
-        string checkb = node_name.to_str()+"@"+key.to_str();
-        if (settings.excludes.count(checka) == 0 &&
-            settings.excludes.count(checkb) == 0)
+        if (!isExcludedAttribute(node_name, i))
         {
+            xmq::str value;
+            actions->loadValue(i, &value);
             printAlignedAttribute(i, value, indent+node_name.l+1, align, do_indent);
             do_indent = true;
         }
         i = actions->nextAttribute(i);
     }
-    output(")");
+    out.put(')');
 }
 
-void RenderImplementation::printAligned(void *i,
+template<typename Actions>
+void RenderImplementation<Actions>::printAligned(void *i,
                                         xmq::str value,
                                         int indent,
                                         int align,
                                         bool do_indent)
 {
     if (do_indent) printIndent(indent);
-    if (actions->isNodeComment(i))
+    switch (actions->nodeKind(i))
+    {
+    case xmq::NodeType::comment:
     {
         trimWhiteSpace(&value);
         printComment(value, indent);
+        break;
     }
-    else
-    if (actions->isNodeData(i))
+    case xmq::NodeType::text:
     {
         printEscaped(value, false, indent, true);
+        break;
     }
-    else
-    if (actions->isNodeCData(i))
+    case xmq::NodeType::cdata:
     {
         // CData becomes just quoted content. The cdata node is not preserved.
         xmq::str cdata;
         actions->loadValue(i, &cdata);
         printEscaped(cdata, false, indent, true);
+        break;
     }
-    else
-    if (actions->isNodeDocType(i))
+    case xmq::NodeType::doctype:
     {
         renderElementNameSugarDT();
         xmq::str pi_data;
         actions->loadValue(i, &pi_data);
-        output(" = ");
+        out.put(" = ");
         printEscaped(pi_data, false, indent, false);
+        break;
     }
-    else
-    if (actions->isNodePI(i))
+    case xmq::NodeType::pi:
     {
         xmq::str key;
         actions->loadName(i, &key);
@@ -470,11 +544,12 @@ void RenderImplementation::printAligned(void *i,
         actions->loadValue(i, &pi_data);
         if (pi_data.l > 0)
         {
-            output(" = ");
+            out.put(" = ");
             printEscaped(pi_data, false, indent, false);
         }
+        break;
     }
-    else
+    default:
     {
         xmq::str key;
         actions->loadName(i, &key);
@@ -490,20 +565,22 @@ void RenderImplementation::printAligned(void *i,
             int ind = indent+align+3;
             if (containsNewlines(value))
             {
-                output("=");
+                out.put('=');
                 ind = indent;
                 printIndent(indent);
             }
             else
             {
-                output("= ");
+                out.put("= ");
             }
             printEscaped(value, false, ind, false);
         }
     }
+    }
 }
 
-void RenderImplementation::printAlignedAttribute(void *i,
+template<typename Actions>
+void RenderImplementation<Actions>::printAlignedAttribute(void *i,
                                                  xmq::str value,
                                                  int indent,
                                                  int align,
@@ -524,65 +601,93 @@ void RenderImplementation::printAlignedAttribute(void *i,
         int ind = indent+align+3;
         if (containsNewlines(value))
         {
-            output("=");
+            out.put('=');
             ind = indent+4;
             printIndent(ind);
         }
         else
         {
-            output("= ");
+            out.put("= ");
         }
         printEscaped(value, false, ind, false);
     }
 }
 
-void RenderImplementation::renderNode(void *i, int indent, bool newline, vector<pair<void*,xmq::str>> *lines, size_t *align)
+template<typename Actions>
+bool RenderImplementation<Actions>::addNodeLine(void *i, int indent, vector<pair<void*,xmq::str>> *lines, size_t *align)
 {
-    xmq::str key;
-    actions->loadName(i, &key);
     xmq::str value;
-    actions->loadValue(i, &value);
-    if (actions->isNodeData(i) || actions->isNodeComment(i) || actions->isNodePI(i) || actions->isNodeDocType(i))
+    xmq::NodeType kind = actions->nodeKind(i);
+    if (kind == xmq::NodeType::text || kind == xmq::NodeType::comment ||
+        kind == xmq::NodeType::pi || kind == xmq::NodeType::doctype)
     {
-        lines->push_back( { i, value });
+        actions->loadValue(i, &value);
+        addLine(i, value, false, indent, lines, align);
+        return true;
     }
-    else
     if (nodeHasNoChildren(i))
     {
-        lines->push_back( { i, xmq::str("",0) });
+        addLine(i, xmq::str("",0), false, indent, lines, align);
+        return true;
     }
-    else
     if (nodeHasSingleDataChild(i, &value))
     {
-        lines->push_back( { i, value });
+        addLine(i, value, true, indent, lines, align);
+        return true;
+    }
+    return false;
+}
+
+template<typename Actions>
+void RenderImplementation<Actions>::renderNode(void *i, int indent, bool newline, vector<pair<void*,xmq::str>> *lines, size_t *align)
+{
+    if (addNodeLine(i, indent, lines, align)) return;
+    flushLines(lines, indent, align);
+    renderWithChildren(i, indent+4);
+}
+
+template<typename Actions>
+void RenderImplementation<Actions>::flushLines(vector<pair<void*,xmq::str>> *lines, int indent, size_t *align)
+{
+    for (auto &p : *lines)
+    {
+        printAligned(p.first, p.second, indent+4, *align, true);
+    }
+    lines->clear();
+    *align = 0;
+}
+
+template<typename Actions>
+void RenderImplementation<Actions>::addLine(void *i, xmq::str value, bool align_key, int indent,
+                                            vector<pair<void*,xmq::str>> *lines, size_t *align)
+{
+    lines->push_back( { i, value });
+    if (align_key)
+    {
+        xmq::str key;
+        actions->loadName(i, &key);
         if (key.l > *align)
         {
             *align = key.l;
         }
     }
-    else
+    if (settings.align_limit > 0 && lines->size() >= settings.align_limit)
     {
-        // Flush any accumulated key:value lines with proper alignment.
-        for (auto &p : *lines)
-        {
-            printAligned(p.first, p.second, indent+4, *align, true);
-        }
-        lines->clear();
-        *align = 0;
-        renderWithChildren(i, indent+4);
+        flushLines(lines, indent, align);
     }
 }
 
 /*
     Render is only invoked on nodes that have children nodes other than a single content node.
+    The descendants are rendered with an explicit stack of blocks, thus deep documents do not
+    exhaust the call stack.
 */
-void RenderImplementation::renderWithChildren(void *node, int indent, bool newline)
+template<typename Actions>
+void RenderImplementation<Actions>::renderWithChildren(void *node, int indent, bool newline)
 {
     assert(node != NULL);
-    size_t align = 0;
-    vector<pair<void*,xmq::str>> lines;
 
-    if (actions->isNodeComment(node))
+    if (actions->nodeKind(node) == xmq::NodeType::comment)
     {
         xmq::str value;
         actions->loadValue(node, &value);
@@ -590,6 +695,43 @@ void RenderImplementation::renderWithChildren(void *node, int indent, bool newli
         return;
     }
 
+    startBlock(node, indent, newline);
+    if (indent == 0 && settings.render_threads > 1 && renderChildrenInParallel(node, indent))
+    {
+        printIndent(indent);
+        out.put('}');
+        return;
+    }
+
+    // The caller has flushed its run, the blocks below start with an empty one.
+    assert(lines_.empty() && blocks_.empty());
+    size_t align = 0;
+    blocks_.push_back( { firstChild(node), indent });
+    while (!blocks_.empty())
+    {
+        Block &b = blocks_.back();
+        void *i = b.next;
+        if (i == NULL)
+        {
+            flushLines(&lines_, b.indent, &align);
+            printIndent(b.indent);
+            out.put('}');
+            blocks_.pop_back();
+            continue;
+        }
+        b.next = nextChild(i);
+        if (addNodeLine(i, b.indent, &lines_, &align)) continue;
+
+        int child_indent = b.indent+4;
+        flushLines(&lines_, b.indent, &align);
+        startBlock(i, child_indent, true);
+        blocks_.push_back( { firstChild(i), child_indent });
+    }
+}
+
+template<typename Actions>
+void RenderImplementation<Actions>::startBlock(void *node, int indent, bool newline)
+{
     printIndent(indent, newline);
 
     xmq::str name;
@@ -600,108 +742,225 @@ void RenderImplementation::renderWithChildren(void *node, int indent, bool newli
     {
         printAttributes(node, indent);
         printIndent(indent);
-        output("{");
+        out.put('{');
     }
     else
     {
-        output(" {");
+        out.put(" {");
     }
-    void *i = actions->firstNode(node);
-    while (i)
-    {
-        renderNode(i, indent, newline, &lines, &align);
-        i = actions->nextSibling(i);
-    }
-    // Flush any accumulated key:value lines with proper alignment.
-    for (auto &p : lines)
+}
+
+template<typename Actions>
+bool RenderImplementation<Actions>::isRenderedWithChildren(void *i)
+{
+    xmq::str value;
+    xmq::NodeType kind = actions->nodeKind(i);
+    return kind != xmq::NodeType::text &&
+        kind != xmq::NodeType::comment &&
+        kind != xmq::NodeType::pi &&
+        kind != xmq::NodeType::doctype &&
+        !nodeHasNoChildren(i) &&
+        !nodeHasSingleDataChild(i, &value);
+}
+
+template<typename Actions>
+bool RenderImplementation<Actions>::isElement(void *node)
+{
+    switch (actions->nodeKind(node))
     {
-        printAligned(p.first, p.second, indent+4, align, true);
+    case xmq::NodeType::text:
+    case xmq::NodeType::comment:
+    case xmq::NodeType::cdata:
+    case xmq::NodeType::pi:
+    case xmq::NodeType::doctype:
+    case xmq::NodeType::declaration:
+        return false;
+    default:
+        return true;
     }
-    printIndent(indent);
-    output("}");
 }
 
-int RenderImplementation::output(const char* fmt, ...)
+// The state shared by the workers of renderChildrenInParallel.
+struct ParallelOutput
 {
-    if (render_type_ == xmq::RenderType::html)
+    ParallelOutput(xmq_implementation::OutputSink *o, size_t num_ranges) : out(o), done(num_ranges), buffers(num_ranges) {}
+
+    xmq_implementation::OutputSink *out;
+    mutex m;
+    condition_variable cv;
+    size_t next {};    // The next range to be taken by a worker.
+    size_t written {}; // The ranges before this one have been written.
+    vector<bool> done;
+    // The output of the ranges that were rendered before the ranges before them were written.
+    vector<vector<char>> buffers;
+    exception_ptr error;
+
+    bool isNext(size_t k)
     {
-        va_list args;
-        char buffer[65536];
-        buffer[65535] = 0;
-        va_start(args, fmt);
-        vsnprintf(buffer, 65536, fmt, args);
-        va_end(args);
-        size_t len = strlen(buffer);
-        for (size_t i=0; i<len; ++i)
+        lock_guard<mutex> lock(m);
+        return k == written;
+    }
+
+    // The worker of the range that is next in order writes the finished ranges that follow it.
+    void finish(size_t k)
+    {
+        unique_lock<mutex> lock(m);
+        done[k] = true;
+        if (k != written) return;
+        while (written < done.size() && done[written])
         {
-            string escape;
-            if (!escapeHtml(buffer[i], &escape))
-            {
-                out_buffer->insert(out_buffer->end(), buffer[i]);
-            }
-            else
-            {
-                out_buffer->insert(out_buffer->end(), escape.begin(), escape.end());
-            }
+            // The range is done, thus nobody else writes while the lock is released.
+            size_t j = written;
+            lock.unlock();
+            out->putRaw(buffers[j].data(), buffers[j].size());
+            vector<char>().swap(buffers[j]);
+            lock.lock();
+            written = j+1;
         }
-        return 0;
+        lock.unlock();
+        cv.notify_all();
     }
 
-    va_list args;
-    char buffer[65536];
-    buffer[65535] = 0;
-    va_start(args, fmt);
-    vsnprintf(buffer, 65356, fmt, args);
-    va_end(args);
-    out_buffer->insert(out_buffer->end(), buffer, buffer+strlen(buffer));
-    return 0;
-}
+    // Stop handing out ranges, the first error is rethrown when the workers have stopped.
+    void fail(exception_ptr e)
+    {
+        {
+            lock_guard<mutex> lock(m);
+            if (!error) error = e;
+            next = done.size();
+        }
+        cv.notify_all();
+    }
+};
 
-int RenderImplementation::outputNoEscape(const char* fmt, ...)
+// Buffers the output of a range until the ranges before it have been written,
+// then the range writes straight to the output.
+struct RangeOutputWriter : xmq::OutputWriter
 {
-    va_list args;
-    char buffer[65536];
-    buffer[65535] = 0;
-    va_start(args, fmt);
-    vsnprintf(buffer, 65356, fmt, args);
-    va_end(args);
-    out_buffer->insert(out_buffer->end(), buffer, buffer+strlen(buffer));
-    return 0;
-}
+    RangeOutputWriter(ParallelOutput *p) : p_(p) {}
+
+    void start(size_t k) { k_ = k; direct_ = false; }
+    void write(const char *b, size_t len)
+    {
+        vector<char> &buf = p_->buffers[k_];
+        if (!direct_ && p_->isNext(k_))
+        {
+            direct_ = true;
+            p_->out->putRaw(buf.data(), buf.size());
+            vector<char>().swap(buf);
+        }
+        if (direct_) p_->out->putRaw(b, len);
+        else buf.insert(buf.end(), b, b+len);
+    }
+
+private:
+    ParallelOutput *p_;
+    size_t k_ {};
+    bool direct_ {};
+};
 
-void RenderImplementation::render()
+/*
+    Render the children of node like renderWithChildren does, using a pool of workers.
+    The children are split into ranges that start with a child rendered with its own
+    children. The key = value lines are aligned within the runs between such children,
+    thus each range can be rendered by itself. The range that is next in order is written
+    straight to the output, the others are buffered until the ranges before them are written.
+*/
+template<typename Actions>
+bool RenderImplementation<Actions>::renderChildrenInParallel(void *node, int indent)
 {
-    void *root = actions->root();
+    vector<void*> children;
+    for (void *i = firstChild(node); i != NULL; i = nextChild(i)) children.push_back(i);
+
+    size_t threads = settings.render_threads;
+    // Enough ranges to keep the workers busy, not so many that the handover dominates.
+    size_t range_size = max((size_t)1, children.size()/(16*threads));
+    vector<size_t> ranges; // Start of each range, the last entry is the end.
+    ranges.push_back(0);
+    for (size_t i = 1; i < children.size(); ++i)
+    {
+        if (i-ranges.back() >= range_size && isRenderedWithChildren(children[i])) ranges.push_back(i);
+    }
+    ranges.push_back(children.size());
+    size_t num_ranges = ranges.size()-1;
+    if (num_ranges < 2) return false;
 
-    if (use_color_)
+    ParallelOutput p(&out, num_ranges);
+    // Workers can not run too far ahead, the finished buffers wait in memory until written.
+    size_t window = 4*threads;
+
+    auto worker = [&]()
     {
-        if (render_type_ == xmq::RenderType::terminal)
+        RangeOutputWriter writer(&p);
+        RenderImplementation ri(actions, render_type_, use_color_, &writer, settings);
+        ri.element_name_color = element_name_color;
+        ri.element_name_sugar_color = element_name_sugar_color;
+        ri.attribute_name_sugar_color = attribute_name_sugar_color;
+        ri.comment_color = comment_color;
+        ri.data_color = data_color;
+        ri.reset_color = reset_color;
+        try
         {
-            useAnsiColors();
+            for (;;)
+            {
+                size_t k;
+                {
+                    unique_lock<mutex> lock(p.m);
+                    p.cv.wait(lock, [&]() { return p.next >= num_ranges || p.next < p.written+window; });
+                    if (p.next >= num_ranges) return;
+                    k = p.next++;
+                }
+                writer.start(k);
+                size_t align = 0;
+                for (size_t i = ranges[k]; i < ranges[k+1]; ++i)
+                {
+                    ri.renderNode(children[i], indent, true, &ri.lines_, &align);
+                }
+                ri.flushLines(&ri.lines_, indent, &align);
+                ri.out.flush();
+                p.finish(k);
+            }
         }
-        if (render_type_ == xmq::RenderType::html)
+        catch (...)
         {
-            useHtmlColors();
+            // Nothing more is written by this worker, not even when ri is destroyed.
+            ri.out.discard();
+            p.fail(current_exception());
         }
-    }
+    };
+
+    vector<thread> workers;
+    for (size_t t = 1; t < min(threads, num_ranges); ++t) workers.push_back(thread(worker));
+    worker();
+    for (auto &w : workers) w.join();
+    if (p.error) rethrow_exception(p.error);
+    return true;
+}
+
+template<typename Actions>
+void RenderImplementation<Actions>::render()
+{
+    void *root = skipExcluded(actions->root());
+
+    useColors();
     // Xml usually only have a single root data node,
     // but xml with comments can have multiple root
     // nodes where some are comment nodes.
     bool newline = false;
     while (root != NULL)
     {
-        xmq::str tmp;
-        // Handle the special cases, single empty node and single node with data content.
-        if (nodeHasSingleDataChild(root, &tmp) || nodeHasNoChildren(root))
+        xmq::str value("", 0);
+        // Handle the special cases, single node with data content and single empty node.
+        if (nodeHasSingleDataChild(root, &value))
         {
-            vector<pair<void*,xmq::str>> lines;
-            size_t align = 0;
-            renderNode(root, 0, false, &lines, &align);
-            // Flush any accumulated key:value lines with proper alignment.
-            for (auto &p : lines)
-            {
-                printAligned(p.first, p.second, 0, align, false);
-            }
+            xmq::str key;
+            actions->loadName(root, &key);
+            printAligned(root, value, 0, key.l, false);
+        }
+        else if (nodeHasNoChildren(root))
+        {
+            if (!isElement(root)) actions->loadValue(root, &value);
+            printAligned(root, value, 0, 0, false);
         }
         else
         {
@@ -710,7 +969,7 @@ void RenderImplementation::render()
         newline = true;
         if (actions->parent(root))
         {
-            root = actions->nextSibling(root);
+            root = nextChild(root);
         }
         else
         {
@@ -718,11 +977,284 @@ void RenderImplementation::render()
         }
     }
 
-    output("\n");
+    out.put('\n');
+    out.flush();
 }
 
 void xmq::renderXMQ(xmq::RenderActions *actions, vector<char> *out, xmq::Config &settings)
 {
-    RenderImplementation ri(actions, settings.render_type, settings.use_color, out, settings);
+    xmq_implementation::VectorOutputWriter writer(out);
+    renderXMQ(actions, &writer, settings);
+}
+
+template<typename Actions>
+static void renderWith(Actions *actions, xmq::OutputWriter *out, xmq::Config &settings)
+{
+    RenderImplementation<Actions> ri(actions, settings.render_type, settings.use_color, out, settings);
     ri.render();
 }
+
+void xmq::renderXMQ(xmq::RenderActions *actions, xmq::OutputWriter *out, xmq::Config &settings)
+{
+    if (auto *a = dynamic_cast<xmq::DocumentRenderActions*>(actions)) renderWith(a, out, settings);
+    else if (auto *a = dynamic_cast<RenderActionsRapidXML*>(actions)) renderWith(a, out, settings);
+    else renderWith(actions, out, settings);
+}
+
+/*
+    Renders xmq while the xml is parsed. The renderer needs to know how an element ends
+    before it can start it: childless and with a single text it becomes a key = value line,
+    aligned with its siblings, otherwise it gets a block of its own. Thus the undecided
+    element is kept until a second child, or a child that is not text, arrives or until it
+    ends. The lines are kept until the run of lines ends, or reaches the align limit.
+    Only the run and the undecided element are stored, in a small document that is
+    cleared whenever they have been printed.
+*/
+struct StreamingRender : xmq::ParseActions
+{
+    StreamingRender(xmq::OutputWriter *w, xmq::Config &s) :
+        actions_(&doc_), ri_(&actions_, s.render_type, s.use_color, w, s)
+    {
+        ri_.useColors();
+    }
+    // A parse error leaves finish uncalled, then the output that is still buffered is dropped.
+    ~StreamingRender() { if (!finished_) ri_.out.discard(); }
+
+    void *root() { return (void*)1; }
+    char *allocateCopy(const char *content, size_t len) { return copies_.copy(content, len); }
+    // The tokens are copied into the document when appended.
+    bool referToInput() { return true; }
+    void *appendElement(void *parent, xmq::Token t);
+    void appendComment(void *parent, xmq::Token t) { appendLeaf(parent, xmq::NodeType::comment, none_, t); }
+    void appendData(void *parent, xmq::Token t);
+    void appendAttribute(void *parent, xmq::Token key, xmq::Token value);
+    void appendCData(void *parent, xmq::Token t) { appendLeaf(parent, xmq::NodeType::cdata, none_, t); }
+    void appendPI(void *parent, xmq::Token name, xmq::Token value) { appendLeaf(parent, xmq::NodeType::pi, name, value); }
+    void appendDocType(void *parent, xmq::Token t) { appendLeaf(parent, xmq::NodeType::doctype, none_, t); }
+    // End the elements that are still open and flush the output.
+    void finish();
+
+private:
+    // The document is level 0, the handle of level i is i+1.
+    struct Level
+    {
+        void *node {};      // The element in doc_, until it is decided.
+        void *data {};      // Its text, while that is its only child.
+        bool decided {};    // The element has been started as a block.
+        bool excluded {};   // The element, or one of its parents, is excluded.
+        int indent {};      // The indent of a decided element.
+    };
+    xmq::Document doc_;
+    xmq::DocumentRenderActions actions_;
+    RenderImplementation<xmq::DocumentRenderActions> ri_;
+    vector<Level> levels_ {1};
+    size_t depth_ {}; // The deepest level that is open.
+    // The run of lines of the innermost decided element. The values are loaded when
+    // the run is printed, since the text arena of the document moves when it grows.
+    vector<pair<void*,xmq::str>> lines_;
+    size_t align_ {};
+    bool newline_ {}; // A top level node has been rendered.
+    bool finished_ {};
+    const xmq::Token none_ {xmq::TokenType::none, NULL};
+    xmq_implementation::TokenCopies copies_;
+
+    size_t enter(void *parent);
+    void decide(size_t level);
+    void loadLineValue(void *node, xmq::str *value);
+    void addLine(size_t level, void *node, bool align_key);
+    void flushLines(int indent);
+    void appendLeaf(void *parent, xmq::NodeType type, xmq::Token name, xmq::Token value);
+    void endElement();
+    void clearWhenIdle();
+};
+
+/*
+    End the elements below parent, a node is about to be appended to it.
+    Returns the level of parent.
+*/
+size_t StreamingRender::enter(void *parent)
+{
+    copies_.recycle();
+    size_t level = (size_t)parent-1;
+    assert(level <= depth_);
+    while (depth_ > level) endElement();
+    return level;
+}
+
+/*
+    The element at level has more than a single text, start it as a block.
+    The lines before it, in the run of its parent, are printed first.
+*/
+void StreamingRender::decide(size_t level)
+{
+    Level &e = levels_[level];
+    assert(!e.decided && !e.excluded);
+    bool top = level == 1;
+    e.indent = top ? 0 : levels_[level-1].indent+4;
+    if (!top) flushLines(levels_[level-1].indent);
+
+    ri_.startBlock(e.node, e.indent, top ? newline_ : true);
+    newline_ = true;
+    e.decided = true;
+    e.node = NULL;
+    if (e.data != NULL)
+    {
+        addLine(level, e.data, false);
+        e.data = NULL;
+    }
+}
+
+// The value of a line, an element has its single text as value.
+void StreamingRender::loadLineValue(void *node, xmq::str *value)
+{
+    *value = xmq::str("", 0);
+    if (actions_.nodeKind(node) == xmq::NodeType::open)
+    {
+        void *data = actions_.firstNode(node);
+        if (data != NULL) actions_.loadValue(data, value);
+        return;
+    }
+    actions_.loadValue(node, value);
+}
+
+/*
+    Add a line to the run of the decided element at level. The lines
+    of the top level are printed right away, each on its own.
+*/
+void StreamingRender::addLine(size_t level, void *node, bool align_key)
+{
+    xmq::str key;
+    if (align_key) actions_.loadName(node, &key);
+    if (level == 0)
+    {
+        xmq::str value;
+        loadLineValue(node, &value);
+        ri_.printAligned(node, value, 0, key.l, false);
+        newline_ = true;
+        return;
+    }
+    lines_.push_back( { node, xmq::str() });
+    if (key.l > align_) align_ = key.l;
+    if (ri_.settings.align_limit > 0 && lines_.size() >= ri_.settings.align_limit)
+    {
+        flushLines(levels_[level].indent);
+    }
+}
+
+void StreamingRender::flushLines(int indent)
+{
+    for (auto &p : lines_) loadLineValue(p.first, &p.second);
+    ri_.flushLines(&lines_, indent, &align_);
+}
+
+void *StreamingRender::appendElement(void *parent, xmq::Token t)
+{
+    size_t level = enter(parent);
+    Level &p = levels_[level];
+    bool excluded = p.excluded ||
+        (ri_.excludes.hasElementRules() && ri_.excludes.excludeElement(xmq::str(t.value, t.len)));
+    // An excluded element is skipped, the parent could still get a single text.
+    if (!excluded && level > 0 && !p.decided) decide(level);
+
+    depth_ = level+1;
+    if (levels_.size() <= depth_) levels_.resize(depth_+1);
+    Level &e = levels_[depth_];
+    e = Level();
+    e.excluded = excluded;
+    if (!excluded) e.node = doc_.appendElement(doc_.root(), t);
+    return (void*)(depth_+1);
+}
+
+void StreamingRender::appendData(void *parent, xmq::Token t)
+{
+    size_t level = enter(parent);
+    Level &p = levels_[level];
+    if (level > 0 && !p.excluded && !p.decided && p.data == NULL)
+    {
+        // The first child, the element is still a key = value line.
+        doc_.appendData(p.node, t);
+        p.data = actions_.firstNode(p.node);
+        return;
+    }
+    appendLeaf(parent, xmq::NodeType::text, none_, t);
+}
+
+void StreamingRender::appendAttribute(void *parent, xmq::Token key, xmq::Token value)
+{
+    // The attributes arrive before the children.
+    Level &e = levels_[(size_t)parent-1];
+    assert((size_t)parent-1 == depth_ && !e.decided);
+    copies_.recycle();
+    if (!e.excluded) doc_.appendAttribute(e.node, key, value);
+}
+
+void StreamingRender::appendLeaf(void *parent, xmq::NodeType type, xmq::Token name, xmq::Token value)
+{
+    size_t level = enter(parent);
+    Level &p = levels_[level];
+    if (p.excluded)
+    {
+        return;
+    }
+    if (level > 0 && !p.decided) decide(level);
+
+    switch (type)
+    {
+    case xmq::NodeType::comment: doc_.appendComment(doc_.root(), value); break;
+    case xmq::NodeType::cdata: doc_.appendCData(doc_.root(), value); break;
+    case xmq::NodeType::pi: doc_.appendPI(doc_.root(), name, value); break;
+    case xmq::NodeType::doctype: doc_.appendDocType(doc_.root(), value); break;
+    default: doc_.appendData(doc_.root(), value);
+    }
+    addLine(level, xmq::Document::nodeHandle(doc_.node(1).last_child), false);
+    clearWhenIdle();
+}
+
+void StreamingRender::endElement()
+{
+    Level &e = levels_[depth_];
+    depth_--;
+    if (e.excluded) return;
+    if (!e.decided)
+    {
+        // Childless or with a single text, a line in the run of the parent.
+        addLine(depth_, e.node, e.data != NULL);
+    }
+    else
+    {
+        flushLines(e.indent);
+        ri_.printIndent(e.indent);
+        ri_.out.put('}');
+    }
+    clearWhenIdle();
+}
+
+/*
+    Clear the document when nothing in it waits to be printed.
+*/
+void StreamingRender::clearWhenIdle()
+{
+    if (!lines_.empty()) return;
+    for (size_t i = depth_; i > 0; --i)
+    {
+        if (levels_[i].excluded) continue;
+        if (!levels_[i].decided) return;
+        break;
+    }
+    doc_.clear();
+}
+
+void StreamingRender::finish()
+{
+    while (depth_ > 0) endElement();
+    ri_.out.put('\n');
+    ri_.out.flush();
+    finished_ = true;
+}
+
+void xmq::renderXMQFromXML(const char *filename, const char *xml, size_t len, OutputWriter *out, xmq::Config &config)
+{
+    StreamingRender sr(out, config);
+    parseXML(&sr, filename, xml, len, config);
+    sr.finish();
+}
@@ -0,0 +1,329 @@
+/*
+ Copyright (c) 2019-2020 Fredrik Öhrström
+
+ MIT License
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include "xmq_implementation.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define XMQ_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace xmq_implementation;
+
+// The plain byte at a time scanners. They finish what the vector
+// scanners leave at the end, and do all the work without simd.
+
+static const char *skipWhiteSpaceScalar(const char *p, const char *end)
+{
+    while (p < end && isWhiteSpace(*p)) p++;
+    return p;
+}
+
+static const char *skipAsciiScalar(const char *p, const char *end)
+{
+    while (p < end && !(*p & 0x80)) p++;
+    return p;
+}
+
+static const char *findReservedCharacterScalar(const char *p, const char *end)
+{
+    while (p < end && !isReserved(*p)) p++;
+    return p;
+}
+
+static const char *findCharOrZeroScalar(const char *p, const char *end, char c)
+{
+    while (p < end && *p != c && *p != 0) p++;
+    return p;
+}
+
+static size_t countNewlinesScalar(const char *p, const char *end)
+{
+    size_t n = 0;
+    for (; p < end; ++p) if (*p == '\n') n++;
+    return n;
+}
+
+#ifdef XMQ_X86_SIMD
+
+// The vector scanners are stamped out twice from the same source, for sse2
+// that every x86-64 cpu has, and for avx2 that is picked at runtime when the
+// cpu has it. A mask bit is set for every byte in the vector that matched.
+// LEAVE runs before returning. The avx2 scanners clear the upper halves of the
+// ymm registers there, gcc does not insert vzeroupper at -Os and the sse code
+// that runs afterwards is then slowed down by the dirty upper state.
+
+#define XMQ_VECTOR_SCANNERS(NAME, TARGET, VEC, WIDTH, SET1, LOADU, CMPEQ, OR, MOVEMASK, LEAVE) \
+                                                                        \
+TARGET static const char *skipWhiteSpace##NAME(const char *p, const char *end) \
+{                                                                       \
+    const VEC sp = SET1(' '), tab = SET1('\t'), cr = SET1('\r'), nl = SET1('\n'); \
+    while (end-p >= WIDTH)                                              \
+    {                                                                   \
+        VEC v = LOADU((const VEC*)p);                                   \
+        uint32_t m = MOVEMASK(OR(OR(CMPEQ(v, sp), CMPEQ(v, tab)), OR(CMPEQ(v, cr), CMPEQ(v, nl)))); \
+        m = ~m & (uint32_t)((1ull << WIDTH)-1);                         \
+        if (m) { LEAVE; return p + __builtin_ctz(m); }                  \
+        p += WIDTH;                                                     \
+    }                                                                   \
+    LEAVE;                                                              \
+    return skipWhiteSpaceScalar(p, end);                                \
+}                                                                       \
+                                                                        \
+TARGET static const char *findReservedCharacter##NAME(const char *p, const char *end) \
+{                                                                       \
+    const VEC sp = SET1(' '), tab = SET1('\t'), cr = SET1('\r'), nl = SET1('\n'); \
+    const VEC zero = SET1(0), quote = SET1('\''), eq = SET1('=');       \
+    const VEC bo = SET1('{'), bc = SET1('}'), po = SET1('('), pc = SET1(')'); \
+    while (end-p >= WIDTH)                                              \
+    {                                                                   \
+        VEC v = LOADU((const VEC*)p);                                   \
+        VEC ws = OR(OR(CMPEQ(v, sp), CMPEQ(v, tab)), OR(CMPEQ(v, cr), CMPEQ(v, nl))); \
+        VEC other = OR(OR(CMPEQ(v, zero), CMPEQ(v, quote)), CMPEQ(v, eq)); \
+        VEC brackets = OR(OR(CMPEQ(v, bo), CMPEQ(v, bc)), OR(CMPEQ(v, po), CMPEQ(v, pc))); \
+        uint32_t m = MOVEMASK(OR(OR(ws, other), brackets));             \
+        if (m) { LEAVE; return p + __builtin_ctz(m); }                  \
+        p += WIDTH;                                                     \
+    }                                                                   \
+    LEAVE;                                                              \
+    return findReservedCharacterScalar(p, end);                         \
+}                                                                       \
+                                                                        \
+TARGET static const char *findCharOrZero##NAME(const char *p, const char *end, char c) \
+{                                                                       \
+    const VEC zero = SET1(0), ch = SET1(c);                             \
+    while (end-p >= WIDTH)                                              \
+    {                                                                   \
+        VEC v = LOADU((const VEC*)p);                                   \
+        uint32_t m = MOVEMASK(OR(CMPEQ(v, zero), CMPEQ(v, ch)));        \
+        if (m) { LEAVE; return p + __builtin_ctz(m); }                  \
+        p += WIDTH;                                                     \
+    }                                                                   \
+    LEAVE;                                                              \
+    return findCharOrZeroScalar(p, end, c);                             \
+}                                                                       \
+                                                                        \
+TARGET static const char *skipAscii##NAME(const char *p, const char *end) \
+{                                                                       \
+    while (end-p >= WIDTH)                                              \
+    {                                                                   \
+        uint32_t m = MOVEMASK(LOADU((const VEC*)p));                    \
+        if (m) { LEAVE; return p + __builtin_ctz(m); }                  \
+        p += WIDTH;                                                     \
+    }                                                                   \
+    LEAVE;                                                              \
+    return skipAsciiScalar(p, end);                                     \
+}                                                                       \
+                                                                        \
+TARGET static size_t countNewlines##NAME(const char *p, const char *end) \
+{                                                                       \
+    const VEC nl = SET1('\n');                                          \
+    size_t n = 0;                                                       \
+    while (end-p >= WIDTH)                                              \
+    {                                                                   \
+        VEC v = LOADU((const VEC*)p);                                   \
+        n += __builtin_popcount((uint32_t)MOVEMASK(CMPEQ(v, nl)));      \
+        p += WIDTH;                                                     \
+    }                                                                   \
+    LEAVE;                                                              \
+    return n + countNewlinesScalar(p, end);                             \
+}
+
+XMQ_VECTOR_SCANNERS(SSE2, , __m128i, 16,
+                    _mm_set1_epi8, _mm_loadu_si128, _mm_cmpeq_epi8, _mm_or_si128, _mm_movemask_epi8, (void)0)
+
+XMQ_VECTOR_SCANNERS(AVX2, __attribute__((target("avx2"))), __m256i, 32,
+                    _mm256_set1_epi8, _mm256_loadu_si256, _mm256_cmpeq_epi8, _mm256_or_si256, _mm256_movemask_epi8,
+                    _mm256_zeroupper())
+
+#endif
+
+struct Scanners
+{
+    const char *(*skipWhiteSpace)(const char *p, const char *end);
+    const char *(*findReservedCharacter)(const char *p, const char *end);
+    const char *(*findCharOrZero)(const char *p, const char *end, char c);
+    size_t (*countNewlines)(const char *p, const char *end);
+    const char *(*skipAscii)(const char *p, const char *end);
+};
+
+static Scanners pickScanners()
+{
+#ifdef XMQ_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return { skipWhiteSpaceAVX2, findReservedCharacterAVX2, findCharOrZeroAVX2, countNewlinesAVX2, skipAsciiAVX2 };
+    }
+    return { skipWhiteSpaceSSE2, findReservedCharacterSSE2, findCharOrZeroSSE2, countNewlinesSSE2, skipAsciiSSE2 };
+#else
+    return { skipWhiteSpaceScalar, findReservedCharacterScalar, findCharOrZeroScalar, countNewlinesScalar, skipAsciiScalar };
+#endif
+}
+
+// Picked on first use, so that the scanners also work from static constructors.
+static const Scanners &scanners()
+{
+    static const Scanners s = pickScanners();
+    return s;
+}
+
+const char *xmq_implementation::skipWhiteSpace(const char *p, const char *end)
+{
+    return scanners().skipWhiteSpace(p, end);
+}
+
+const char *xmq_implementation::findReservedCharacter(const char *p, const char *end)
+{
+    return scanners().findReservedCharacter(p, end);
+}
+
+const char *xmq_implementation::findCharOrZero(const char *p, const char *end, char c)
+{
+    return scanners().findCharOrZero(p, end, c);
+}
+
+size_t xmq_implementation::countNewlines(const char *p, const char *end)
+{
+    return scanners().countNewlines(p, end);
+}
+
+const char *xmq_implementation::findInvalidUtf8(const char *p, const char *end)
+{
+    for (;;)
+    {
+        p = scanners().skipAscii(p, end);
+        if (p == end) return end;
+        // The class of the lead byte gives the length of the sequence.
+        uint8_t c = char_classes[(unsigned char)*p];
+        size_t n = c & utf8_lead2 ? 2 : c & utf8_lead3 ? 3 : c & utf8_lead4 ? 4 : 0;
+        if (n == 0 || (size_t)(end-p) < n) return p;
+        // The range of the second byte rules out overlong forms, surrogates and too large code points.
+        unsigned char second = p[1], low = 0x80, high = 0xbf;
+        switch ((unsigned char)*p)
+        {
+        case 0xe0: low = 0xa0; break;
+        case 0xed: high = 0x9f; break;
+        case 0xf0: low = 0x90; break;
+        case 0xf4: high = 0x8f; break;
+        }
+        if (second < low || second > high) return p;
+        for (size_t i = 2; i < n; ++i)
+        {
+            if ((p[i] & 0xc0) != 0x80) return p;
+        }
+        p += n;
+    }
+}
+
+// Step over the quote at p, as the parser does. Returns NULL if it does not end.
+static const char *skipQuote(const char *p, const char *end)
+{
+    // The empty string ''
+    if (p+2 < end && p[1] == '\'' && p[2] != '\'') return p+2;
+
+    const char *q = p;
+    while (q < end && *q == '\'') q++;
+    size_t depth = q-p;
+    for (;;)
+    {
+        q = findCharOrZero(q, end, '\'');
+        if (q >= end || *q == 0) return NULL;
+        const char *r = q;
+        while (r < end && *r == '\'') r++;
+        // Fewer quotes than the depth are content, more are an error.
+        if ((size_t)(r-q) == depth) return r;
+        if ((size_t)(r-q) > depth) return NULL;
+        q = r;
+    }
+}
+
+bool xmq_implementation::findChildBoundaries(const char *buf, size_t len, size_t p, size_t min_gap, std::vector<size_t> *splits)
+{
+    const char *end = buf+len;
+    const char *i = buf+p;
+    const char *last = i;
+    int depth = 1;
+    for (;;)
+    {
+        i = skipWhiteSpace(i, end);
+        if (i >= end) return false;
+        switch (*i)
+        {
+        case 0:
+            return false;
+        case '{':
+            depth++;
+            i++;
+            break;
+        case '}':
+            if (--depth == 0)
+            {
+                splits->push_back(i-buf);
+                return true;
+            }
+            i++;
+            // A child ends here, the next token starts the next child.
+            if (depth == 1 && (size_t)(i-last) >= min_gap)
+            {
+                splits->push_back(i-buf);
+                last = i;
+            }
+            break;
+        case '=':
+        case '(':
+        case ')':
+            i++;
+            break;
+        case '\'':
+            i = skipQuote(i, end);
+            if (i == NULL) return false;
+            break;
+        case '/':
+            if (i+1 < end && i[1] == '/')
+            {
+                i = findCharOrZero(i+2, end, '\n');
+                break;
+            }
+            if (i+1 < end && i[1] == '*')
+            {
+                const char *q = i+2;
+                for (;;)
+                {
+                    q = findCharOrZero(q, end, '*');
+                    if (q >= end || *q == 0) return false;
+                    if (q+1 < end && q[1] == '/') break;
+                    q++;
+                }
+                i = q+2;
+                break;
+            }
+            // Fall through, a single slash starts a text.
+        default:
+            i = findReservedCharacter(i, end);
+        }
+    }
+}
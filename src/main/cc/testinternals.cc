@@ -25,10 +25,13 @@ SOFTWARE.
 #include "util.h"
 #include "xmq.h"
 #include "xmq_implementation.h"
+#include "xmq_rapidxml.h"
+#include "rapidxml/rapidxml_print.hpp"
 
 #include <string>
 #include <string.h>
 #include <memory>
+#include <set>
 
 using namespace std;
 
@@ -45,22 +48,22 @@ void test_add_string()
     auto s1 = ws("alfa.beta");
     auto s2 = ws("alfa.gamma");
     StringCount c;
-    add_string(s1.get(), c);
-    add_string(s1.get(), c);
-    add_string(s1.get(), c);
-    add_string(s1.get(), c);
-    add_string(s1.get(), c);
-    add_string(s1.get(), c);
-    add_string(s1.get(), c);
-    add_string(s2.get(), c);
-    add_string(s2.get(), c);
-    add_string(s2.get(), c);
-    add_string(s2.get(), c);
-    add_string(s2.get(), c);
-    add_string(s2.get(), c);
-    add_string(s2.get(), c);
-
-    string s = find_prefix(s1.get(), c);
+    add_string(s1.get(), strlen(s1.get()), c);
+    add_string(s1.get(), strlen(s1.get()), c);
+    add_string(s1.get(), strlen(s1.get()), c);
+    add_string(s1.get(), strlen(s1.get()), c);
+    add_string(s1.get(), strlen(s1.get()), c);
+    add_string(s1.get(), strlen(s1.get()), c);
+    add_string(s1.get(), strlen(s1.get()), c);
+    add_string(s2.get(), strlen(s2.get()), c);
+    add_string(s2.get(), strlen(s2.get()), c);
+    add_string(s2.get(), strlen(s2.get()), c);
+    add_string(s2.get(), strlen(s2.get()), c);
+    add_string(s2.get(), strlen(s2.get()), c);
+    add_string(s2.get(), strlen(s2.get()), c);
+    add_string(s2.get(), strlen(s2.get()), c);
+
+    string s = string(s1.get(), find_prefix(s1.get(), strlen(s1.get()), c));
     if (s != "alfa.") {
         printf("Expected alfa. but got %s\n", s.c_str());
         exit(1);
@@ -121,6 +124,13 @@ void test_incidental()
     checkEquals(&buffer, "   alfa\n  beta\n gamma\ndelta\n");
     buffer.clear();
 
+    // The range version appends, as when joining quotes.
+    const char *ex8 = "alfa\n       beta\n     gamma";
+    buffer.push_back('>');
+    xmq_implementation::removeIncidentalWhiteSpace(ex8, strlen(ex8), 6, &buffer);
+    checkEquals(&buffer, ">alfa\n beta\ngamma");
+    buffer.clear();
+
     /*
     const char *ex7 = "     alfa\n\n     beta\n     gamma\n     delta\n";
     buffer.insert(buffer.end(), ex7, ex7+strlen(ex7));
@@ -129,8 +139,913 @@ void test_incidental()
     buffer.clear();*/
 }
 
+void test_a_utf8(const string &s, size_t expected)
+{
+    const char *bad = xmq_implementation::findInvalidUtf8(s.c_str(), s.c_str()+s.size());
+    if ((size_t)(bad-s.c_str()) != expected)
+    {
+        printf("ERROR! Expected invalid utf8 at %zu but got %zu\n", expected, (size_t)(bad-s.c_str()));
+        exit(1);
+    }
+}
+
 void test_utf8_check()
 {
+    test_a_utf8("", 0);
+    test_a_utf8("alfa", 4);
+    test_a_utf8("\xc3\xa5\xe2\x82\xac\xf0\x9f\x98\x80", 9); // å € and an emoji.
+    test_a_utf8("\xef\xbb\xbf<a/>", 7); // Byte order mark.
+    test_a_utf8("a\x80", 1);         // Continuation byte without a lead byte.
+    test_a_utf8("a\xc0\xaf", 1);     // Overlong forms.
+    test_a_utf8("a\xe0\x80\xaf", 1);
+    test_a_utf8("a\xf0\x80\x80\xaf", 1);
+    test_a_utf8("a\xed\xa0\x80", 1); // Surrogate.
+    test_a_utf8("a\xf4\x90\x80\x80", 1); // Above 0x10ffff.
+    test_a_utf8("a\xf5\x80\x80\x80", 1);
+    test_a_utf8("a\xe2\x82", 1);     // Truncated at the end.
+    test_a_utf8("a\xe2\x28\xa1", 1); // Second byte is not a continuation.
+    test_a_utf8("a\xe2\x82\x28", 1); // Third byte is not a continuation.
+
+    // Every position of the vectors and of the scalar tail.
+    for (size_t i = 0; i < 100; ++i)
+    {
+        string s = string(i, 'x')+"\xc3\xa5"+string(100-i, 'y');
+        test_a_utf8(s, s.size());
+        s[i+1] = 'z';
+        test_a_utf8(s, i);
+    }
+
+    try
+    {
+        xmq_implementation::checkUtf8("in.xml", "<a>\n  \xc3\xa5\xff</a>", 13);
+        printf("ERROR! Expected invalid utf8 to be reported!\n");
+        exit(1);
+    }
+    catch (xmq::Error &e)
+    {
+        if (string(e.what()) != "in.xml:2:5: error: invalid utf8\n")
+        {
+            printf("ERROR! Unexpected message: %s", e.what());
+            exit(1);
+        }
+    }
+}
+
+// Records the parse events as text, to compare different ways of parsing.
+struct RecordingParseActions : xmq::ParseActions
+{
+    string log;
+    vector<unique_ptr<char[]>> copies;
+    size_t num_nodes {};
+
+    void *root() { return (void*)1; }
+    char *allocateCopy(const char *content, size_t len)
+    {
+        char *c = new char[len];
+        memcpy(c, content, len-1);
+        c[len-1] = 0;
+        copies.push_back(unique_ptr<char[]>(c));
+        return c;
+    }
+    void *appendElement(void *parent, xmq::Token t)
+    {
+        num_nodes++;
+        log += to_string((size_t)parent)+" E "+t.value+"\n";
+        return (void*)(num_nodes+1);
+    }
+    void appendComment(void *parent, xmq::Token t) { log += to_string((size_t)parent)+" C "+t.value+"\n"; }
+    void appendData(void *parent, xmq::Token t) { log += to_string((size_t)parent)+" D "+t.value+"\n"; }
+    void appendAttribute(void *parent, xmq::Token key, xmq::Token value)
+    {
+        log += to_string((size_t)parent)+" A "+key.value+"="+value.value+"\n";
+    }
+    void appendCData(void *parent, xmq::Token t) { log += to_string((size_t)parent)+" X "+t.value+"\n"; }
+    void appendPI(void *parent, xmq::Token name, xmq::Token value)
+    {
+        log += to_string((size_t)parent)+" P "+name.value+" "+value.value+"\n";
+    }
+    void appendDocType(void *parent, xmq::Token t) { log += to_string((size_t)parent)+" T "+t.value+"\n"; }
+};
+
+// Implements only the hooks that every ParseActions must have.
+struct BasicParseActions : xmq::ParseActions
+{
+    string log;
+    vector<unique_ptr<char[]>> copies;
+
+    void *root() { return (void*)1; }
+    char *allocateCopy(const char *content, size_t len)
+    {
+        char *c = new char[len];
+        memcpy(c, content, len-1);
+        c[len-1] = 0;
+        copies.push_back(unique_ptr<char[]>(c));
+        return c;
+    }
+    void *appendElement(void *parent, xmq::Token t) { log += string("E ")+t.value+"\n"; return (void*)2; }
+    void appendComment(void *parent, xmq::Token t) { log += string("C ")+t.value+"\n"; }
+    void appendData(void *parent, xmq::Token t) { log += string("D ")+t.value+"\n"; }
+    void appendAttribute(void *parent, xmq::Token key, xmq::Token value) { log += string("A ")+key.value+"\n"; }
+};
+
+// Hides the type of the RenderActions and does not override nodeKind, thus the
+// renderer goes through the virtual functions and the isNode queries.
+struct ForwardingRenderActions : xmq::RenderActions
+{
+    xmq::RenderActions *a;
+    ForwardingRenderActions(xmq::RenderActions *ra) : a(ra) {}
+    void *root() { return a->root(); }
+    void *firstNode(void *node) { return a->firstNode(node); }
+    void *nextSibling(void *node) { return a->nextSibling(node); }
+    bool hasAttributes(void *node) { return a->hasAttributes(node); }
+    void *firstAttribute(void *node) { return a->firstAttribute(node); }
+    void *nextAttribute(void *attr) { return a->nextAttribute(attr); }
+    void *parent(void *node) { return a->parent(node); }
+    bool isNodeData(void *node) { return a->isNodeData(node); }
+    bool isNodeComment(void *node) { return a->isNodeComment(node); }
+    bool isNodeCData(void *node) { return a->isNodeCData(node); }
+    bool isNodePI(void *node) { return a->isNodePI(node); }
+    bool isNodeDocType(void *node) { return a->isNodeDocType(node); }
+    bool isNodeDeclaration(void *node) { return a->isNodeDeclaration(node); }
+    void loadName(void *node, xmq::str *name) { a->loadName(node, name); }
+    void loadValue(void *node, xmq::str *data) { a->loadValue(node, data); }
+};
+
+// Hands out the input a few bytes at a time.
+struct ChunkedReader : xmq::InputReader
+{
+    const char *p;
+    size_t left;
+    size_t chunk {1};
+    ChunkedReader(const string &s) : p(s.c_str()), left(s.size()) {}
+    size_t read(char *buf, size_t len)
+    {
+        size_t n = chunk;
+        chunk = chunk%13+1;
+        if (n > len) n = len;
+        if (n > left) n = left;
+        memcpy(buf, p, n);
+        p += n;
+        left -= n;
+        return n;
+    }
+};
+
+void test_streaming_parse()
+{
+    string xmq = "config {\n";
+    for (int i=0; i<5000; ++i)
+    {
+        xmq += "    // Entry "+to_string(i)+"\n";
+        xmq += "    entry(id = "+to_string(i)+" name = 'x y') {\n";
+        xmq += "        value = "+to_string(i*7)+"\n";
+        xmq += "        text = '\n            alfa\n              beta\n            '\n";
+        xmq += "        joined = 'a'\\n\n                 'b'\n";
+        xmq += "        /* multi\n           line */\n";
+        xmq += "    }\n";
+    }
+    // A token that is larger than the initial window.
+    xmq += "    big = '"+string(200000, 'x')+"'\n";
+    xmq += "}\n";
+
+    xmq::Config config;
+    RecordingParseActions whole;
+    xmq::parseXMQ(&whole, "", xmq.c_str(), config);
+
+    RecordingParseActions streamed;
+    ChunkedReader reader(xmq);
+    xmq::parseXMQ(&streamed, "", &reader, config);
+
+    if (whole.num_nodes != 20002 || whole.log != streamed.log)
+    {
+        printf("Streaming parse differs from buffer parse! %zu nodes vs %zu nodes\n",
+               whole.num_nodes, streamed.num_nodes);
+        exit(1);
+    }
+}
+
+string parseError(const string &xmq, bool streamed)
+{
+    xmq::Config config;
+    RecordingParseActions ra;
+    try
+    {
+        if (streamed)
+        {
+            ChunkedReader reader(xmq);
+            xmq::parseXMQ(&ra, "e", &reader, config);
+        }
+        else
+        {
+            xmq::parseXMQ(&ra, "e", xmq.c_str(), config);
+        }
+    }
+    catch (xmq::Error &e)
+    {
+        string msg = e.what();
+        return msg.substr(0, msg.find('\n'));
+    }
+    return "";
+}
+
+void test_error_position()
+{
+    // Enough lines before the error to make the streaming parser discard some of them.
+    string xmq = "config {\n";
+    for (int i=0; i<20000; ++i) xmq += "    entry = "+to_string(i)+"\n";
+    xmq += "    broken ( x\n}\n";
+    const char *expected = "e:20003:1: error: expected =";
+
+    string whole = parseError(xmq, false);
+    string streamed = parseError(xmq, true);
+    if (whole != expected || streamed != expected)
+    {
+        printf("ERROR! Expected \"%s\"\nbut got \"%s\"\nand streamed \"%s\"\n",
+               expected, whole.c_str(), streamed.c_str());
+        exit(1);
+    }
+
+    string msg = parseError("a {\n  b = '''x\n", false);
+    if (msg != "e:3:1: error: unexpected eof in quoted text")
+    {
+        printf("ERROR! Unexpected \"%s\"\n", msg.c_str());
+        exit(1);
+    }
+}
+
+void test_a_xml_parse(const char *xml, xmq::TreeType tt, bool preserve_ws, const char *expected)
+{
+    xmq::Config config;
+    config.tree_type = tt;
+    config.preserve_ws = preserve_ws;
+    RecordingParseActions ra;
+    xmq::parseXML(&ra, "", xml, config);
+
+    if (ra.log != expected)
+    {
+        printf("ERROR! Parsing xml:\n%s\nExpected:\n%sbut got:\n%s", xml, expected, ra.log.c_str());
+        exit(1);
+    }
+}
+
+void test_xml_parse()
+{
+    test_a_xml_parse("<?xml version=\"1.0\"?>\n<!DOCTYPE a [ <!ELEMENT a ANY> ]>\n"
+                     "<a x='1' y=\"&lt;&#65;&#x42;&amp;\"> text &gt; <b/> <!--c-->\n"
+                     "  <?pi  data?><![CDATA[<raw>]]></a>",
+                     xmq::TreeType::xml, false,
+                     "1 T a [ <!ELEMENT a ANY> ]\n"
+                     "1 E a\n"
+                     "2 A x=1\n"
+                     "2 A y=<AB&\n"
+                     "2 D text >\n"
+                     "2 E b\n"
+                     "2 C c\n"
+                     "2 P pi data\n"
+                     "2 X <raw>\n");
+
+    // Whitespace only text is dropped, preserved text keeps its surrounding whitespace.
+    test_a_xml_parse("<a>\n  <b> x </b>\n</a>", xmq::TreeType::xml, true,
+                     "1 E a\n"
+                     "2 E b\n"
+                     "3 D  x \n");
+
+    // Html void elements have no closing tag and attributes can lack values.
+    test_a_xml_parse("<html><body><br><input checked type='text'></body></html>", xmq::TreeType::html, false,
+                     "1 E html\n"
+                     "2 E body\n"
+                     "3 E br\n"
+                     "3 E input\n"
+                     "5 A checked=checked\n"
+                     "5 A type=text\n");
+
+    // The largest code point, and the code points next to the surrogates.
+    test_a_xml_parse("<a>&#x10FFFF;&#xD7FF;&#57344;</a>", xmq::TreeType::xml, false,
+                     "1 E a\n"
+                     "2 D \xF4\x8F\xBF\xBF\xED\x9F\xBF\xEE\x80\x80\n");
+
+    // Entities without digits, zero, surrogates and too large codes are not characters.
+    const char *bad[] = { "<a>p&#x;q</a>", "<a b='x&#;y'/>", "<a>&#0;</a>", "<a>&#x0000;</a>",
+                          "<a>&#xD800;</a>", "<a>&#57343;</a>", "<a>&#x110000;</a>",
+                          "<a>&#18446744073709551681;</a>", "<a>&#x10000000000000041;</a>" };
+    for (const char *xml : bad)
+    {
+        string msg;
+        try
+        {
+            xmq::Config config;
+            RecordingParseActions ra;
+            xmq::parseXML(&ra, "e", xml, config);
+        }
+        catch (xmq::Error &e)
+        {
+            msg = e.what();
+        }
+        if (msg.find("error: invalid numeric character entity") == string::npos)
+        {
+            printf("ERROR! Expected an invalid entity in %s, got \"%s\"\n", xml, msg.c_str());
+            exit(1);
+        }
+    }
+
+    // Without the xml hooks the cdata becomes data, the doctype and the processing instruction are dropped.
+    xmq::Config config;
+    BasicParseActions ba;
+    xmq::parseXML(&ba, "e", "<!DOCTYPE a><a><?p q?><![CDATA[x<y]]></a>", config);
+    if (ba.log != "E a\nD x<y\n")
+    {
+        printf("ERROR! Expected the cdata as data, got:\n%s\n", ba.log.c_str());
+        exit(1);
+    }
+}
+
+void test_document()
+{
+    string xmq = "// Comment\nconfig {\n";
+    for (int i=0; i<2000; ++i)
+    {
+        xmq += "    entry(id = "+to_string(i)+" name = 'x y' flag) {\n";
+        xmq += "        value = "+to_string(i*7)+"\n";
+        xmq += "        'free text'\n";
+        xmq += "        empty\n";
+        xmq += "    }\n";
+    }
+    xmq += "}\n";
+
+    // Add a root node that was not allocated by the document.
+    xmq::Config config;
+    config.root = "top";
+
+    // The text arena moves several times while parsing.
+    xmq::Document doc;
+    xmq::parseXMQ(&doc, "", xmq.c_str(), config);
+    xmq::DocumentRenderActions dactions(&doc);
+    vector<char> dout;
+    xmq::renderXMQ(&dactions, &dout, config);
+
+    rapidxml::xml_document<> rdoc;
+    ParseActionsRapidXML pactions(&rdoc);
+    xmq::parseXMQ(&pactions, "", xmq.c_str(), config);
+    RenderActionsRapidXML ractions(rdoc.first_node());
+    vector<char> rout;
+    xmq::renderXMQ(&ractions, &rout, config);
+
+    if (dout != rout)
+    {
+        printf("ERROR! Rendering the document differs from rendering rapidxml!\n");
+        exit(1);
+    }
+
+    // Referring to the input gives the same document, with the names and values in place.
+    rapidxml::xml_document<> sdoc;
+    ParseActionsRapidXML sactions(&sdoc, true);
+    xmq::parseXMQ(&sactions, "", xmq.c_str(), config);
+    RenderActionsRapidXML sractions(sdoc.first_node());
+    vector<char> sout;
+    xmq::renderXMQ(&sractions, &sout, config);
+    const char *name = sdoc.first_node()->first_node("config")->name();
+    if (dout != sout || name < xmq.c_str() || name >= xmq.c_str()+xmq.size())
+    {
+        printf("ERROR! Rendering rapidxml that refers to the input differs!\n");
+        exit(1);
+    }
+
+    ForwardingRenderActions factions(&dactions);
+    vector<char> fout;
+    xmq::renderXMQ(&factions, &fout, config);
+    if (dout != fout)
+    {
+        printf("ERROR! Rendering through the virtual functions differs!\n");
+        exit(1);
+    }
+
+    // The names are interned, all entries share the same name and attribute keys.
+    uint32_t top = doc.node(1).first_child;
+    uint32_t first = doc.node(doc.node(top).last_child).first_child; // The comment is the first child.
+    uint32_t second = doc.node(first).next_sibling;
+    if (doc.node(first).name != doc.node(second).name ||
+        doc.attribute(doc.node(first).first_attribute).key != doc.attribute(doc.node(second).first_attribute).key ||
+        strcmp(doc.text(doc.node(second).name), "entry"))
+    {
+        printf("ERROR! Names are not interned!\n");
+        exit(1);
+    }
+}
+
+string printWithRapidXML(const string &xmq, bool html, bool indent)
+{
+    rapidxml::xml_document<> doc;
+    if (html)
+    {
+        doc.append_node(doc.allocate_node(rapidxml::node_doctype, "!DOCTYPE", "html"));
+    }
+    else
+    {
+        rapidxml::xml_node<> *node = doc.allocate_node(rapidxml::node_declaration, "?xml");
+        doc.append_node(node);
+        node->append_attribute(doc.allocate_attribute("version", "1.0"));
+        node->append_attribute(doc.allocate_attribute("encoding", "UTF-8"));
+    }
+    ParseActionsRapidXML pactions(&doc);
+    xmq::Config config;
+    xmq::parseXMQ(&pactions, "", xmq.c_str(), config);
+    int flags = (html ? rapidxml::print_html : 0) | (indent ? 0 : rapidxml::print_no_indenting);
+    string out;
+    rapidxml::print(back_inserter(out), doc, flags);
+    return out;
+}
+
+string writeXML(const string &xmq, bool html, bool indent)
+{
+    vector<char> out;
+    xmq_implementation::VectorOutputWriter vw(&out);
+    xmq_implementation::XMLWriter writer(&vw, html, indent);
+    writer.appendDeclaration();
+    xmq::Config config;
+    xmq::parseXMQ(&writer, "", xmq.c_str(), config);
+    writer.finish();
+    return string(out.begin(), out.end());
+}
+
+void test_xml_writer()
+{
+    const char *tests[] = {
+        "config { a = 1 b(x = 'y' z) { c d = 'e & <f>' } // Comment\n 'text' 'more' }",
+        "a { b = '''it's''' c(k = '''a \"b\" 'c'\nd''') e(f = 'say \"hi\"') }",
+        "html { body { p { 'Some ' b = bold ' and ' span = 'inline' br 'text' } img(src = x) div /* c */ } }",
+        "html { head { meta(charset = utf8) script } body(class = a) { input(checked = checked) textarea = 'x' } }",
+    };
+    for (const char *t : tests)
+    {
+        for (int html = 0; html < 2; ++html)
+        {
+            for (int indent = 0; indent < 2; ++indent)
+            {
+                string expected = printWithRapidXML(t, html, indent);
+                string got = writeXML(t, html, indent);
+                if (expected != got)
+                {
+                    printf("ERROR! Writing xml html=%d indent=%d differs for %s\n"
+                           "Expected:\n%s\nGot:\n%s\n", html, indent, t, expected.c_str(), got.c_str());
+                    exit(1);
+                }
+            }
+        }
+    }
+}
+
+string renderXMLAsXMQ(const string &xml, size_t align_limit, bool streamed)
+{
+    xmq::Config config;
+    config.align_limit = align_limit;
+    config.excludes.insert("skip");
+    vector<char> out;
+    if (streamed)
+    {
+        xmq_implementation::VectorOutputWriter writer(&out);
+        xmq::renderXMQFromXML("", xml.c_str(), xml.size(), &writer, config);
+    }
+    else
+    {
+        xmq::Document doc;
+        xmq::parseXML(&doc, "", xml.c_str(), xml.size(), config);
+        xmq::DocumentRenderActions dactions(&doc);
+        xmq::renderXMQ(&dactions, &out, config);
+    }
+    return string(out.begin(), out.end());
+}
+
+void test_streaming_render()
+{
+    const char *tests[] = {
+        "<!-- top --><config a='1' bb='2'><a>1</a><bbb>2</bbb><c/><!-- x --><d><e>3</e><f/></d><g>4</g></config>",
+        "<p>Some <b>bold</b> text<skip>x</skip><q>only<skip/></q><r><skip/>data</r></p><!-- after -->",
+        "<a><b>x<![CDATA[<y>]]></b><?pi z?><c>multi\nline</c><d k='v'>text</d><e><f><g>deep</g></f></e></a>",
+        "<x>single</x>",
+    };
+    for (const char *t : tests)
+    {
+        for (size_t limit : { 0, 1, 2, 10000 })
+        {
+            string expected = renderXMLAsXMQ(t, limit, false);
+            string got = renderXMLAsXMQ(t, limit, true);
+            if (expected != got)
+            {
+                printf("ERROR! Rendering while parsing with align limit %zu differs for %s\n"
+                       "Expected:\n%s\nGot:\n%s\n", limit, t, expected.c_str(), got.c_str());
+                exit(1);
+            }
+        }
+    }
+}
+
+void test_align_limit()
+{
+    // A run longer than the limit restarts the alignment after each limit lines.
+    string xml = "<r><a>1</a><bb>2</bb><ccc>3</ccc><d>4</d><eeeee>5</eeeee></r>";
+    string expected =
+        "r {\n"
+        "    a  = 1\n"
+        "    bb = 2\n"
+        "    ccc = 3\n"
+        "    d   = 4\n"
+        "    eeeee = 5\n"
+        "}\n";
+    for (bool streamed : { false, true })
+    {
+        string got = renderXMLAsXMQ(xml, 2, streamed);
+        if (got != expected)
+        {
+            printf("ERROR! Expected:\n%sbut got:\n%s", expected.c_str(), got.c_str());
+            exit(1);
+        }
+    }
+
+    // There is no limit by default, the longest key aligns the whole run.
+    xml = "<r>";
+    expected = "r {\n";
+    for (int i = 0; i < 10001; ++i)
+    {
+        xml += "<k>"+to_string(i)+"</k>";
+        expected += "    k  = "+to_string(i)+"\n";
+    }
+    xml += "<kk>x</kk></r>";
+    expected += "    kk = x\n}\n";
+    for (bool streamed : { false, true })
+    {
+        string got = renderXMLAsXMQ(xml, xmq::Config().align_limit, streamed);
+        if (got != expected)
+        {
+            printf("ERROR! The default align limit splits a run of %d lines!\n", 10002);
+            exit(1);
+        }
+    }
+}
+
+void test_compress()
+{
+    // More than ten prefixes, the numbers need two digits.
+    string xml = "<root>";
+    for (int p=0; p<12; ++p)
+    {
+        for (int i=0; i<30; ++i) xml += "<"+string(6, 'a'+p)+".item"+to_string(i)+"/>";
+    }
+    xml += "</root>";
+
+    xmq::Config config;
+    xmq::Document doc;
+    xmq::parseXML(&doc, "", xml.c_str(), config);
+    xmq::DocumentRenderActions dactions(&doc);
+    vector<char> before;
+    xmq::renderXMQ(&dactions, &before, config);
+
+    Prefixes prefixes;
+    find_all_strings(&dactions, prefixes.string_count);
+    find_all_prefixes(&dactions, &prefixes);
+    CompressedRenderActions cactions(&dactions, &prefixes);
+    vector<char> compressed;
+    xmq::renderXMQ(&cactions, &compressed, config);
+
+    vector<char> after;
+    xmq::renderXMQ(&dactions, &after, config);
+
+    string out(compressed.begin(), compressed.end());
+    if (prefixes.num_prefixes != 12 ||
+        prefixes.prefixes["llllll.item"] != 11 ||
+        out.find("\n    11:29\n") == string::npos)
+    {
+        printf("ERROR! Unexpected compression:\n%s", out.c_str());
+        exit(1);
+    }
+    if (before != after)
+    {
+        printf("ERROR! Compression changed the document!\n");
+        exit(1);
+    }
+}
+
+// Throws away the output, only the size is kept.
+struct CountingOutputWriter : xmq::OutputWriter
+{
+    size_t bytes {};
+    void write(const char *buf, size_t len) { bytes += len; }
+};
+
+void test_deep()
+{
+    // Deep enough to exhaust the call stack if the nesting was followed by recursion.
+    const int depth = 200000;
+    string xmq;
+    for (int i = 0; i < depth; ++i) xmq += "level(id = x) {\n";
+    xmq += "value = 1\n";
+    for (int i = 0; i < depth; ++i) xmq += "}\n";
+
+    xmq::Config config;
+    xmq::Document doc;
+    xmq::parseXMQ(&doc, "", xmq.c_str(), config);
+    RecordingParseActions streamed;
+    ChunkedReader reader(xmq);
+    xmq::parseXMQ(&streamed, "", &reader, config);
+
+    int found = 0;
+    for (uint32_t n = doc.node(1).first_child; n != 0; n = doc.node(n).first_child) found++;
+    if (found != depth+2 || streamed.num_nodes != (size_t)depth+1)
+    {
+        printf("ERROR! Expected %d nested nodes, found %d!\n", depth+2, found);
+        exit(1);
+    }
+
+    xmq::DocumentRenderActions dactions(&doc);
+    Prefixes prefixes;
+    find_all_strings(&dactions, prefixes.string_count);
+    find_all_prefixes(&dactions, &prefixes);
+
+    // The indentation grows with the depth, thus the output grows with its square.
+    // A shallower document is rendered, that still exhausted the call stack, and
+    // only the size of the output is kept.
+    const size_t n = 50000;
+    xmq = "";
+    for (size_t i = 0; i < n; ++i) xmq += "a{";
+    xmq += "b=1";
+    for (size_t i = 0; i < n; ++i) xmq += "}";
+    xmq::Document shallower;
+    xmq::parseXMQ(&shallower, "", xmq.c_str(), config);
+    xmq::DocumentRenderActions sactions(&shallower);
+    CountingOutputWriter counting;
+    xmq::renderXMQ(&sactions, &counting, config);
+    // Each level has "a {" and "}" on lines of their own, indented by 4 for each level.
+    size_t expected = 4*n*(n-1) + 10*n + 6;
+    if (counting.bytes != expected)
+    {
+        printf("ERROR! Expected %zu bytes rendered, got %zu!\n", expected, counting.bytes);
+        exit(1);
+    }
+}
+
+void test_excludes()
+{
+    set<string> rules = { "@id", "row@style", "*@xmlns*", "meta", "debug*" };
+    xmq_implementation::ExcludeMatcher m(rules);
+    struct { const char *element, *attribute; bool excluded; } attrs[] = {
+        { "row", "id", true },
+        { "cell", "id", true },
+        { "row", "style", true },
+        { "cell", "style", false },
+        { "cell", "xmlns:xsi", true },
+        { "cell", "xmlns", true },
+        { "cell", "xml", false },
+        { "cell", "ids", false },
+    };
+    for (auto &a : attrs)
+    {
+        if (m.excludeAttribute(xmq::str(a.element, strlen(a.element)), xmq::str(a.attribute, strlen(a.attribute))) != a.excluded)
+        {
+            printf("ERROR! Exclude %s@%s should be %d\n", a.element, a.attribute, a.excluded);
+            exit(1);
+        }
+    }
+    if (!m.excludeElement(xmq::str("meta", 4)) ||
+        !m.excludeElement(xmq::str("debug_info", 10)) ||
+        m.excludeElement(xmq::str("metadata", 8)) ||
+        m.excludeElement(xmq::str("row", 3)))
+    {
+        printf("ERROR! Element excludes do not match!\n");
+        exit(1);
+    }
+
+    xmq::Config config;
+    config.excludes = rules;
+    xmq::Document doc;
+    xmq::parseXMQ(&doc, "", "table { meta = x row(id = 1 style = s name = n) { debug_a debug_b = 2 } }", config);
+    xmq::DocumentRenderActions dactions(&doc);
+    vector<char> out;
+    xmq::renderXMQ(&dactions, &out, config);
+    string expected = "table {\n    row(name = n)\n}\n";
+    if (string(out.begin(), out.end()) != expected)
+    {
+        printf("ERROR! Expected:\n%sbut got:\n%s", expected.c_str(), string(out.begin(), out.end()).c_str());
+        exit(1);
+    }
+}
+
+// Fails when more than the given number of bytes have been written, like a full disk.
+struct FailingOutputWriter : xmq::OutputWriter
+{
+    FailingOutputWriter(size_t n) : left(n) {}
+    size_t left;
+    void write(const char *buf, size_t len)
+    {
+        if (len > left) throw xmq::Error("disk full\n");
+        left -= len;
+    }
+};
+
+void test_parallel_render()
+{
+    // Mix children with and without children of their own, the aligned
+    // key = value runs must not be split between the workers.
+    string xmq = "config {\n";
+    for (int i=0; i<3000; ++i)
+    {
+        if (i%7 == 0) xmq += "    // Comment "+to_string(i)+"\n";
+        if (i%3 == 0) xmq += "    key"+string(i%5, 'x')+" = "+to_string(i)+"\n";
+        else xmq += "    entry(id = "+to_string(i)+") { value = "+to_string(i)+" x = 'y z' }\n";
+    }
+    xmq += "}\n";
+
+    xmq::Config config;
+    xmq::Document doc;
+    xmq::parseXMQ(&doc, "", xmq.c_str(), config);
+    xmq::DocumentRenderActions dactions(&doc);
+    vector<char> sequential;
+    xmq::renderXMQ(&dactions, &sequential, config);
+
+    for (int threads : { 2, 3, 8 })
+    {
+        config.render_threads = threads;
+        vector<char> parallel;
+        xmq::renderXMQ(&dactions, &parallel, config);
+        if (parallel != sequential)
+        {
+            printf("ERROR! Rendering with %d threads differs!\n", threads);
+            exit(1);
+        }
+
+        // The error of the worker that writes is thrown to the caller.
+        string error;
+        try
+        {
+            FailingOutputWriter failing(sequential.size()/2);
+            xmq::renderXMQ(&dactions, &failing, config);
+        }
+        catch (xmq::Error &e)
+        {
+            error = e.what();
+        }
+        if (error != "disk full\n")
+        {
+            printf("ERROR! Expected the write error from %d threads, got \"%s\"\n", threads, error.c_str());
+            exit(1);
+        }
+    }
+
+    // A root with a single child can not be split, it is rendered as usual.
+    xmq = "config {\n    entry {\n        key = value\n    }\n}\n";
+    xmq::Document single;
+    xmq::parseXMQ(&single, "", xmq.c_str(), config);
+    xmq::DocumentRenderActions sactions(&single);
+    vector<char> out;
+    xmq::renderXMQ(&sactions, &out, config);
+    if (string(out.begin(), out.end()) != xmq)
+    {
+        printf("ERROR! Expected:\n%sbut got:\n%s", xmq.c_str(), string(out.begin(), out.end()).c_str());
+        exit(1);
+    }
+}
+
+string parseWithThreads(const string &xmq, int threads, bool rapid)
+{
+    xmq::Config config;
+    config.parse_threads = threads;
+    vector<char> out;
+    try
+    {
+        if (rapid)
+        {
+            rapidxml::xml_document<> doc;
+            ParseActionsRapidXML pactions(&doc);
+            xmq::parseXMQ(&pactions, "", xmq.c_str(), config);
+            RenderActionsRapidXML ractions(doc.first_node());
+            xmq::renderXMQ(&ractions, &out, config);
+        }
+        else
+        {
+            xmq::Document doc;
+            xmq::parseXMQ(&doc, "", xmq.c_str(), config);
+            xmq::DocumentRenderActions dactions(&doc);
+            xmq::renderXMQ(&dactions, &out, config);
+        }
+    }
+    catch (xmq::Error &e)
+    {
+        return e.what();
+    }
+    return string(out.begin(), out.end());
+}
+
+void test_quotes()
+{
+    // The quotes must be deeper than the longest run of quotes in the content,
+    // not only deeper than the last run.
+    string xml = "<r><a>x'''y'z</a><b k=\"p'''q'r\"/></r>";
+    string expected = "r {\n    a = ''''x'''y'z''''\n    b(k = ''''p'''q'r'''')\n}\n";
+    for (bool streamed : { false, true })
+    {
+        string got = renderXMLAsXMQ(xml, 0, streamed);
+        if (got != expected)
+        {
+            printf("ERROR! Expected:\n%sbut got:\n%s", expected.c_str(), got.c_str());
+            exit(1);
+        }
+    }
+
+    // An empty quote is an empty value.
+    string xmq = "r {\n    a = ''\n    b = ''\n}\n";
+    expected = "r {\n    a\n    b\n}\n";
+    for (bool rapid : { false, true })
+    {
+        string got = parseWithThreads(xmq, 1, rapid);
+        if (got != expected)
+        {
+            printf("ERROR! Expected:\n%sbut got:\n%s", expected.c_str(), got.c_str());
+            exit(1);
+        }
+    }
+}
+
+void test_parallel_parse()
+{
+    // Braces, quotes and slashes inside quotes, comments and texts must not fool the pre-scan.
+    string xmq = "config {\n";
+    for (int i=0; i<2000; ++i)
+    {
+        switch (i%8)
+        {
+        case 0: xmq += "    // Comment } "+to_string(i)+"\n"; break;
+        case 1: xmq += "    /* { */ entry(id = "+to_string(i)+" note = '}') { v = '{' }\n"; break;
+        case 2: xmq += "    key = '''a '' } b'''\n"; break;
+        case 3: xmq += "    path = a/*b empty = ''\n"; break;
+        case 4: xmq += "    deep { a { b { c = "+to_string(i)+" } } }\n"; break;
+        case 5: xmq += "    'data { with } braces'\n"; break;
+        case 6: xmq += "    line = 'x'\\n\n    'y'\n"; break;
+        default: xmq += "    entry { }\n";
+        }
+    }
+    xmq += "}\n";
+
+    // Broken inputs must report the same error as when parsed by a single thread.
+    string unclosed = xmq;
+    unclosed.insert(unclosed.size()/2, "\n    bad = 'unclosed\n");
+    string extra_brace = xmq;
+    extra_brace.insert(extra_brace.size()/2, "\n    }\n");
+    string no_end = xmq.substr(0, xmq.size()-2);
+
+    for (bool rapid : { false, true })
+    {
+        for (const string &in : { xmq, unclosed, extra_brace, no_end })
+        {
+            string sequential = parseWithThreads(in, 1, rapid);
+            for (int threads : { 2, 3, 8 })
+            {
+                if (parseWithThreads(in, threads, rapid) != sequential)
+                {
+                    printf("ERROR! Parsing with %d threads differs!\n", threads);
+                    exit(1);
+                }
+            }
+        }
+    }
+}
+
+void test_scanners()
+{
+    // Random text built from the interesting characters, so that every
+    // scanner stops at every position of the vectors and the tails.
+    const char *alphabet = " \t\r\n'={}()*/ab\0";
+    string s;
+    unsigned int r = 4711;
+    for (int i=0; i<4096; ++i)
+    {
+        r = r*1103515245+12345;
+        size_t n = (r >> 16) % 16;
+        // Long runs of letters and spaces to get past whole vectors.
+        if (n == 13) s += string((r >> 8) % 70, 'a');
+        else if (n == 0) s += string((r >> 8) % 70, ' ');
+        else s += alphabet[n];
+    }
+    const char *begin = s.c_str();
+    const char *end = begin+s.size();
+
+    for (const char *p = begin; p < end; p += 7)
+    {
+        const char *ws = p;
+        while (ws < end && (*ws == ' ' || *ws == '\t' || *ws == '\r' || *ws == '\n')) ws++;
+        const char *res = p;
+        while (res < end && !strchr(" \t\r\n'={}()", *res)) res++;
+        const char *quote = p;
+        while (quote < end && *quote != '\'' && *quote != 0) quote++;
+        size_t nls = 0;
+        for (const char *i = p; i < end; ++i) if (*i == '\n') nls++;
+
+        if (xmq_implementation::skipWhiteSpace(p, end) != ws ||
+            xmq_implementation::findReservedCharacter(p, end) != res ||
+            xmq_implementation::findCharOrZero(p, end, '\'') != quote ||
+            xmq_implementation::countNewlines(p, end) != nls)
+        {
+            printf("ERROR! Scanners disagree at offset %zu\n", (size_t)(p-begin));
+            exit(1);
+        }
+    }
 }
 
 void print_buf(vector<char> &b)
@@ -184,5 +1099,19 @@ int main(int argc, char **argv)
     test_incidental();
     test_utf8_check();
     test_cr_removal();
+    test_streaming_parse();
+    test_error_position();
+    test_xml_parse();
+    test_document();
+    test_xml_writer();
+    test_streaming_render();
+    test_align_limit();
+    test_compress();
+    test_deep();
+    test_excludes();
+    test_parallel_render();
+    test_quotes();
+    test_parallel_parse();
+    test_scanners();
     printf("OK\n");
 }
@@ -26,12 +26,14 @@
 
 #include <assert.h>
 #include <string>
+#include <stdlib.h>
 #include <string.h>
 #include <map>
 #include <vector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -42,215 +44,388 @@
 
 using namespace std;
 
-void add_string(char *s, StringCount &c)
+uint32_t StringCount::child(uint32_t n, char c)
 {
-    assert(s != NULL);
-    assert(s[0] != 0);
+    uint32_t i = nodes[n].first_child;
+    while (i != 0 && nodes[i].c != c) i = nodes[i].next_sibling;
+    return i;
+}
 
-    //printf("add %s\n", s);
-    char *p = s+1;
+uint32_t StringCount::addChild(uint32_t n, char c, int count)
+{
+    uint32_t i = nodes.size();
+    nodes.push_back(Node());
+    nodes[i].c = c;
+    nodes[i].count = count;
+    nodes[i].next_sibling = nodes[n].first_child;
+    nodes[n].first_child = i;
+    return i;
+}
 
-    int x = 0;
-    while (*p != 0)
+void add_string(const char *s, size_t len, StringCount &c)
+{
+    assert(s != NULL);
+    assert(len > 0);
+
+    // Count every prefix of s, s itself excluded, until a prefix
+    // is seen for the first time. The new prefix starts at its length.
+    uint32_t n = 0;
+    for (size_t l = 1; l < len; ++l)
     {
-        char tmp = *p;
-        *p = 0;
-        string tmps(s);
-        *p = tmp;
-        if (c.count(tmps) == 0)
+        uint32_t next = c.child(n, s[l-1]);
+        if (next == 0)
         {
-            c[tmps] = 1+x;
-            //printf("Set \"%s\" = 1\n", tmps.c_str());
+            c.addChild(n, s[l-1], l);
             break;
         }
-        else
-        {
-            c[tmps]++;
-            //printf("Inc \"%s\" = %d\n", tmps.c_str(), c[tmps]);
-        }
-        p++;
-        x++;
+        c.nodes[next].count++;
+        n = next;
     }
 }
 
-string find_prefix(char *s, StringCount &c)
+size_t find_prefix(const char *s, size_t len, StringCount &c, uint32_t *node)
 {
     assert(s != NULL);
-    assert(s[0] != 0);
+    assert(len > 0);
 
-    char *p = s+1;
-    string prev;
-    size_t prev_count = 0;
-
-    while (*p != 0)
+    // The prefix ends where the count starts to fall.
+    uint32_t n = 0;
+    uint32_t prev = 0;
+    size_t prev_len = 0;
+    int prev_count = 0;
+    for (size_t l = 1; l < len; ++l)
     {
-        char tmp = *p;
-        *p = 0;
-        string tmps(s);
-        *p = tmp;
-        size_t count = 0;
-        if (c.count(tmps) > 0) {
-            count = c[tmps];
-        }
-        //printf("find \"%s\" %zu\n", tmps.c_str(), count);
+        if (n != 0 || l == 1) n = c.child(n, s[l-1]);
+        int count = n != 0 ? c.nodes[n].count : 0;
         if (count < prev_count)
         {
-            //printf("find done %s\n", prev.c_str());
-            return prev;
+            if (node != NULL) *node = prev;
+            return prev_len;
         }
-        prev = tmps;
-        p++;
+        prev = n;
+        prev_len = l;
         prev_count = count;
     }
-    return "";
+    return 0;
 }
 
-bool loadFile(string file, vector<char> *buf)
+static bool isElement(xmq::RenderActions *actions, void *node)
 {
-    int blocksize = 1024;
-    char block[blocksize];
-
-    int fd = open(file.c_str(), O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "Could not open file %s errno=%d\n", file.c_str(), errno);
+    switch (actions->nodeKind(node))
+    {
+    case xmq::NodeType::text:
+    case xmq::NodeType::comment:
+    case xmq::NodeType::cdata:
+    case xmq::NodeType::pi:
+    case xmq::NodeType::doctype:
+    case xmq::NodeType::declaration:
         return false;
+    default:
+        return true;
     }
-    while (true) {
-        ssize_t n = read(fd, block, sizeof(block));
-        if (n == -1) {
-            if (errno == EINTR) {
-                continue;
-            }
-            fprintf(stderr, "Could not read file %s errno=%d\n", file.c_str(), errno);
-            close(fd);
+}
 
-            return false;
-        }
-        buf->insert(buf->end(), block, block+n);
-        if (n < (ssize_t)sizeof(block)) {
-            break;
+// Call visit with the name of the element and the names of its attributes.
+template<typename Visit>
+static void visit_element_names(xmq::RenderActions *actions, void *node, Visit &visit)
+{
+    xmq::str name(NULL, 0);
+    actions->loadName(node, &name);
+    visit(name);
+    for (void *a = actions->firstAttribute(node); a != NULL; a = actions->nextAttribute(a))
+    {
+        actions->loadName(a, &name);
+        visit(name);
+    }
+}
+
+// Call visit with the names of the elements and attributes, in document order.
+// An explicit stack is used, deep documents would exhaust the call stack.
+template<typename Visit>
+static void visit_names(xmq::RenderActions *actions, Visit visit)
+{
+    vector<void*> next; // The next node to visit, for each level below the top.
+    for (void *top = actions->root(); top != NULL; top = actions->nextSibling(top))
+    {
+        if (isElement(actions, top))
+        {
+            visit_element_names(actions, top, visit);
+            next.push_back(actions->firstNode(top));
+            while (!next.empty())
+            {
+                void *node = next.back();
+                if (node == NULL)
+                {
+                    next.pop_back();
+                    continue;
+                }
+                next.back() = actions->nextSibling(node);
+                if (!isElement(actions, node)) continue;
+                visit_element_names(actions, node, visit);
+                next.push_back(actions->firstNode(node));
+            }
         }
+        if (actions->parent(top) == NULL) break;
     }
-    close(fd);
-    return true;
 }
 
-bool loadStdin(vector<char> *buf)
+void find_all_strings(xmq::RenderActions *actions, StringCount &c)
 {
-    int blocksize = 1024;
-    char block[blocksize];
+    visit_names(actions, [&](xmq::str name) { add_string(name.s, name.l, c); });
+}
 
-    int fd = 0;
-    while (true) {
-        ssize_t n = read(fd, block, sizeof(block));
+// Return the trie node that ends with the name, or 0 if there is none.
+static uint32_t find_name(StringCount &c, const char *s, size_t len)
+{
+    uint32_t n = 0;
+    for (size_t i = 0; i < len && (n != 0 || i == 0); ++i) n = c.child(n, s[i]);
+    return n;
+}
+
+static void compress_name(xmq::str name, Prefixes *pr)
+{
+    uint32_t node;
+    size_t len = find_prefix(name.s, name.l, pr->string_count, &node);
+    if (len <= 5) return;
+
+    StringCount &c = pr->string_count;
+    // Copy the number, addChild below may move the nodes.
+    int pn = c.nodes[node].number;
+    if (pn == -1)
+    {
+        pn = c.nodes[node].number = pr->num_prefixes++;
+        pr->prefixes[string(name.s, len)] = pn;
+    }
+    // Extend the trie with the whole name, the counts of the new nodes are zero,
+    // which is what find_prefix assumes for missing nodes.
+    uint32_t n = node;
+    for (size_t i = len; i < name.l; ++i)
+    {
+        uint32_t next = c.child(n, name.s[i]);
+        n = next != 0 ? next : c.addChild(n, name.s[i], 0);
+    }
+    if (c.nodes[n].name == -1)
+    {
+        c.nodes[n].name = pr->names.size();
+        pr->names.push_back(to_string(pn)+":"+string(name.s+len, name.l-len));
+    }
+}
+
+void find_all_prefixes(xmq::RenderActions *actions, Prefixes *pr)
+{
+    visit_names(actions, [&](xmq::str name) { compress_name(name, pr); });
+}
+
+void CompressedRenderActions::loadName(void *node, xmq::str *name)
+{
+    actions_->loadName(node, name);
+    uint32_t n = find_name(prefixes_->string_count, name->s, name->l);
+    if (n == 0) return;
+    int i = prefixes_->string_count.nodes[n].name;
+    if (i == -1) return;
+    const string &compressed = prefixes_->names[i];
+    name->s = compressed.c_str();
+    name->l = compressed.size();
+}
+
+InputBuffer::~InputBuffer()
+{
+    clear();
+}
+
+void InputBuffer::clear()
+{
+    if (map_ != NULL)
+    {
+        munmap(map_, map_size_);
+        map_ = NULL;
+        map_size_ = 0;
+    }
+    vector<char>().swap(mem_);
+    data_ = NULL;
+    size_ = 0;
+}
+
+void InputBuffer::truncate(size_t n)
+{
+    assert(n <= size_);
+    size_ = n;
+    data_[n] = 0;
+}
+
+bool InputBuffer::mapFile(int fd, size_t size)
+{
+    if (size == 0) return false;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    // Reserve room for the file and at least one more byte, rounded up to whole pages.
+    // Then map the file on top of the anonymous reservation. The bytes after the end
+    // of the file are zero, both inside the last page of the file and in the anonymous
+    // page that follows when the file size happens to be a multiple of the page size.
+    // Thus we get the terminating zero without copying anything.
+    size_t map_size = (size + 1 + page - 1) / page * page;
+    void *area = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) return false;
+
+    void *file = mmap(area, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (file == MAP_FAILED)
+    {
+        munmap(area, map_size);
+        return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(area, map_size, MADV_SEQUENTIAL);
+#endif
+    map_ = area;
+    map_size_ = map_size;
+    data_ = (char*)area;
+    size_ = size;
+    return true;
+}
+
+bool InputBuffer::readFd(int fd, size_t size_hint)
+{
+    // When we know the size, room for the file, one spare byte and the terminating zero
+    // lets the read that returns end of file happen without growing the buffer.
+    // Otherwise grow the buffer geometrically.
+    size_t len = 0;
+    size_t cap = size_hint > 0 ? size_hint+2 : 65536;
+    mem_.resize(cap);
+    while (true)
+    {
+        if (len+1 >= cap)
+        {
+            cap *= 2;
+            mem_.resize(cap);
+        }
+        ssize_t n = read(fd, &mem_[len], cap-len-1);
         if (n == -1) {
             if (errno == EINTR) {
                 continue;
             }
-            fprintf(stderr, "Could not read stdin errno=%d\n", errno);
-            close(fd);
-
             return false;
         }
-        buf->insert(buf->end(), block, block+n);
-        if (n < (ssize_t)sizeof(block)) {
-            break;
-        }
+        if (n == 0) break;
+        len += n;
+    }
+    mem_.resize(len+1);
+    mem_[len] = 0;
+    data_ = &mem_[0];
+    size_ = len;
+    return true;
+}
+
+bool loadFile(string file, InputBuffer *buf)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open file %s errno=%d\n", file.c_str(), errno);
+        return false;
+    }
+    struct stat st;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        size = st.st_size;
+    }
+    if (!buf->mapFile(fd, size) && !buf->readFd(fd, size))
+    {
+        fprintf(stderr, "Could not read file %s errno=%d\n", file.c_str(), errno);
+        close(fd);
+        return false;
     }
     close(fd);
     return true;
 }
 
-#define BYTE_TO_BINARY_PATTERN "%c%c%c%c%c%c%c%c"
-#define BYTE_TO_BINARY(byte)  \
-  (byte & 0x80 ? '1' : '0'), \
-  (byte & 0x40 ? '1' : '0'), \
-  (byte & 0x20 ? '1' : '0'), \
-  (byte & 0x10 ? '1' : '0'), \
-  (byte & 0x08 ? '1' : '0'), \
-  (byte & 0x04 ? '1' : '0'), \
-  (byte & 0x02 ? '1' : '0'), \
-  (byte & 0x01 ? '1' : '0')
-
-bool isValidUtf8(vector<char> *data, int *line, int *col)
+bool loadStdin(InputBuffer *buf)
 {
-    int n = 0; // Number of utf8 suffix bytes expected.
-    *col = 0;
-    *line = 1;
-    for(size_t i = 0; i < data->size(); i++)
+    int fd = 0;
+    struct stat st;
+    size_t size = 0;
+    // Stdin redirected from a file can be mapped just like a file.
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && lseek(fd, 0, SEEK_CUR) == 0)
     {
-        unsigned char c = (*data)[i];
-        //printf("C " BYTE_TO_BINARY_PATTERN, BYTE_TO_BINARY(c));
-        if (c == '\n')
-        {
-            *col = 0;
-            (*line) ++;
-        }
+        size = st.st_size;
+    }
+    if (!buf->mapFile(fd, size) && !buf->readFd(fd, size))
+    {
+        fprintf(stderr, "Could not read stdin errno=%d\n", errno);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
 
-        if (n > 0)
-        {
-            // We are expecting suffix bytes
-            if ((c >> 6) != 0b10) {
-                //printf("err1\n");
-                return false;
-            }
-            n--;
-            //printf("now expecting %d\n", n);
-            continue;
-        }
+FileOutputWriter::~FileOutputWriter()
+{
+    if (owned_) close(fd_);
+}
 
-        (*col)++;
-        if ((c >> 5) == 0b110)
-        {
-            // The start byte with top bits 110 means we expect 1 suffix byte.
-            //printf("new utf8 char expecting 1\n");
-            n = 1;
-            continue;
-        }
-        if ((c >> 4) == 0b1110)
-        {
-            // Top bits 1110 means expect 2 bytes.
-            //printf("new utf8 char expecting 2\n");
-            c = 2;
-            continue;
-        }
-        if ((c >> 3) == 0b11110)
-        {
-            // Top bits 11110 means expect 3 bytes.
-            //printf("new utf8 char expecting 3\n");
-            n = 3;
-            continue;
-        }
-        if ((c >> 7) == 1) {
-            //printf("Bad top bit!\n");
-            return false;
+bool FileOutputWriter::open(string file)
+{
+    int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open file %s for writing errno=%d\n", file.c_str(), errno);
+        return false;
+    }
+    if (owned_) close(fd_);
+    fd_ = fd;
+    owned_ = true;
+    file_ = file;
+    return true;
+}
+
+void FileOutputWriter::write(const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::write(fd_, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw xmq::Error("Could not write "+(owned_ ? file_ : string("output"))+" errno="+to_string(errno)+"\n");
         }
+        buf += n;
+        len -= n;
     }
-    //printf("n == %d\n", n);
-    return n == 0;
 }
 
-bool removeCrs(vector<char> *data)
+bool removeCrs(char *data, size_t *len)
 {
-    size_t i, j, n = data->size();
+    size_t n = *len;
+    // Find the first \r, most files have none and then nothing is written.
+    // Keeping the pages clean matters when the data is a private mapping.
+    char *cr = (char*)memchr(data, '\r', n);
+    if (cr == NULL) return false;
 
-    for(i = j = 0; i < n; i++, j++)
+    size_t i, j;
+    for(i = j = cr-data; i < n; i++, j++)
     {
-        if ((*data)[i] == '\r'
+        if (data[i] == '\r'
             && i+1 < n &&
-            (*data)[i+1] == '\n')
+            data[i+1] == '\n')
         {
             i++;
         }
         if (i > j)
         {
-            (*data)[j] = (*data)[i];
+            data[j] = data[i];
         }
     }
 
-    n = i-j;
-
-    while (n--) data->pop_back();
+    *len = j;
 
     return i > j;
 }
+
+bool removeCrs(vector<char> *data)
+{
+    if (data->size() == 0) return false;
+    size_t len = data->size();
+    bool removed = removeCrs(&(*data)[0], &len);
+    data->resize(len);
+    return removed;
+}
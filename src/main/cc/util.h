@@ -26,17 +26,137 @@
 #define UTIL_H
 
 #include <map>
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <string.h>
 
-typedef std::map<std::string,int> StringCount;
+#include "xmq.h"
 
-void add_string(char *s, StringCount &c);
-std::string find_prefix(char *s, StringCount &c);
-bool loadFile(std::string file, std::vector<char> *buf);
-bool loadStdin(std::vector<char> *buf);
-bool isValidUtf8(std::vector<char> *data, int *line, int *col);
+// Counts the prefixes of the names seen by --compress. The prefixes are
+// stored in a trie, each node is a prefix one character longer than its parent.
+struct StringCount
+{
+    struct Node
+    {
+        char c {};           // The last character of the prefix.
+        int count {};
+        int number {-1};     // The number of the prefix, when it is used.
+        int name {-1};       // Index of the compressed name, when a name ends here.
+        uint32_t first_child {};
+        uint32_t next_sibling {};
+    };
+
+    StringCount() : nodes(1) {}
+    // Return the child of node n for character c, or 0 if there is none.
+    uint32_t child(uint32_t n, char c);
+    uint32_t addChild(uint32_t n, char c, int count);
+
+    std::vector<Node> nodes; // nodes[0] is the empty prefix.
+};
+
+// The input to be converted. A regular file is memory mapped, anything
+// else (a pipe for example) is read into memory. The contents are always
+// followed by a terminating zero that is not included in size(), and
+// the contents are writable (private copy on write for mapped files)
+// since rapidxml parses in situ.
+struct InputBuffer
+{
+    InputBuffer() {}
+    ~InputBuffer();
+
+    char *data() { return data_; }
+    size_t size() { return size_; }
+    // Shrink the contents to n bytes and move the terminating zero.
+    void truncate(size_t n);
+    // Release the mapping or the memory.
+    void clear();
+
+private:
+    InputBuffer(const InputBuffer&) = delete;
+    InputBuffer &operator=(const InputBuffer&) = delete;
+
+    bool mapFile(int fd, size_t size);
+    bool readFd(int fd, size_t size_hint);
+
+    char *data_ {};
+    size_t size_ {};
+    void *map_ {};        // Start of the mapping, if memory mapped.
+    size_t map_size_ {};  // Size of the mapping.
+    std::vector<char> mem_; // Used when the input could not be mapped.
+
+    friend bool loadFile(std::string file, InputBuffer *buf);
+    friend bool loadStdin(InputBuffer *buf);
+};
+
+// Writes the output to a file descriptor, stdout or a file.
+struct FileOutputWriter : xmq::OutputWriter
+{
+    FileOutputWriter(int fd) : fd_(fd) {}
+    ~FileOutputWriter();
+    // Create or truncate the file and write to it instead.
+    bool open(std::string file);
+    void write(const char *buf, size_t len);
+
+private:
+    FileOutputWriter(const FileOutputWriter&) = delete;
+    FileOutputWriter &operator=(const FileOutputWriter&) = delete;
+
+    int fd_;
+    bool owned_ {};
+    std::string file_;
+};
+
+void add_string(const char *s, size_t len, StringCount &c);
+// Return the length of the common prefix of s, or 0 if there is none.
+// The trie node of the prefix is stored in node, if given.
+size_t find_prefix(const char *s, size_t len, StringCount &c, uint32_t *node = NULL);
+
+// The common prefixes found by --compress.
+struct Prefixes
+{
+    StringCount string_count;
+    int num_prefixes {};
+    std::map<std::string,int> prefixes; // Printed in this order.
+    std::vector<std::string> names; // The compressed names, e.g. 0:axiom
+};
+
+// Count the prefixes of all element and attribute names.
+void find_all_strings(xmq::RenderActions *actions, StringCount &c);
+// Number the common prefixes and prepare the compressed names.
+void find_all_prefixes(xmq::RenderActions *actions, Prefixes *pr);
+
+// Renders the tree with the common prefixes of element and attribute names
+// replaced by their numbers, org.eventb.core.axiom becomes 0:axiom.
+// The names in the tree are not touched, the same tree can be rendered
+// without compression as well.
+struct CompressedRenderActions : xmq::RenderActions
+{
+    CompressedRenderActions(xmq::RenderActions *a, Prefixes *p) : actions_(a), prefixes_(p) {}
+    void *root() { return actions_->root(); }
+    void *firstNode(void *node) { return actions_->firstNode(node); }
+    void *nextSibling(void *node) { return actions_->nextSibling(node); }
+    bool hasAttributes(void *node) { return actions_->hasAttributes(node); }
+    void *firstAttribute(void *node) { return actions_->firstAttribute(node); }
+    void *nextAttribute(void *attr) { return actions_->nextAttribute(attr); }
+    void *parent(void *node) { return actions_->parent(node); }
+    bool isNodeData(void *node) { return actions_->isNodeData(node); }
+    bool isNodeComment(void *node) { return actions_->isNodeComment(node); }
+    bool isNodeCData(void *node) { return actions_->isNodeCData(node); }
+    bool isNodePI(void *node) { return actions_->isNodePI(node); }
+    bool isNodeDocType(void *node) { return actions_->isNodeDocType(node); }
+    bool isNodeDeclaration(void *node) { return actions_->isNodeDeclaration(node); }
+    xmq::NodeType nodeKind(void *node) { return actions_->nodeKind(node); }
+    void loadName(void *node, xmq::str *name);
+    void loadValue(void *node, xmq::str *data) { actions_->loadValue(node, data); }
+
+private:
+    xmq::RenderActions *actions_;
+    Prefixes *prefixes_;
+};
+bool loadFile(std::string file, InputBuffer *buf);
+bool loadStdin(InputBuffer *buf);
+bool removeCrs(char *data, size_t *len);
 bool removeCrs(std::vector<char> *data);
 
 #endif
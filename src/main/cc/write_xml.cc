@@ -0,0 +1,263 @@
+/*
+ Copyright (c) 2019-2020 Fredrik Öhrström
+
+ MIT License
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include "xmq_implementation.h"
+#include "rapidxml/rapidxml_print.hpp"
+
+using namespace std;
+using namespace xmq_implementation;
+
+// The html elements are classified exactly like the rapidxml printer does,
+// it only reads the name although it wants it to be mutable.
+static bool isInlineElement(xmq::str name)
+{
+    return name.l > 0 && rapidxml::internal::is_inline_element(const_cast<char*>(name.s), name.l);
+}
+
+static bool isVoidElement(xmq::str name)
+{
+    return rapidxml::internal::is_void_element(const_cast<char*>(name.s), name.l);
+}
+
+static xmq::str tokenText(const xmq::Token &t)
+{
+    return xmq::str(t.value, t.len);
+}
+
+void XMLWriter::putIndent(size_t level)
+{
+    // Two spaces for each level, like the rapidxml printer.
+    if (indent_) out_.putRepeat(' ', 2*level);
+}
+
+// Expand & < > in data.
+void XMLWriter::putData(xmq::str s)
+{
+    const char *p = s.s, *end = s.s+s.l;
+    while (p < end)
+    {
+        const char *q = p;
+        while (q < end && !hasCharClass(*q, html_special)) q++;
+        out_.put(p, q-p);
+        if (q == end) break;
+        if (*q == '<') out_.put("&lt;", 4);
+        else if (*q == '>') out_.put("&gt;", 4);
+        else out_.put("&amp;", 5);
+        p = q+1;
+    }
+}
+
+void XMLWriter::putAttribute(xmq::str key, xmq::str value)
+{
+    out_.put(' ');
+    out_.put(key);
+    // Html permits alfa instead of alfa="alfa".
+    if (html_ && key.l == value.l && !strncmp(key.s, value.s, value.l)) return;
+
+    // Quote with " unless the value contains ", then the other quote is escaped.
+    char q = memchr(value.s, '"', value.l) ? '\'' : '"';
+    out_.put('=');
+    out_.put(q);
+    for (size_t i = 0; i < value.l; ++i)
+    {
+        char c = value.s[i];
+        switch (c)
+        {
+        case '<': out_.put("&lt;", 4); break;
+        case '>': out_.put("&gt;", 4); break;
+        case '&': out_.put("&amp;", 5); break;
+        case '\n': out_.put("&#10;", 5); break;
+        case '\'': if (q == '\'') out_.put("&apos;", 6); else out_.put(c); break;
+        case '"': if (q == '"') out_.put("&quot;", 6); else out_.put(c); break;
+        default: out_.put(c);
+        }
+    }
+    out_.put(q);
+}
+
+/*
+    Prepare for a node of the given kind to be appended to parent. The elements below
+    parent are ended and the line of the previous sibling is finished. Returns the level
+    of parent, the new node is indented to that level.
+*/
+size_t XMLWriter::enter(void *parent, Kind kind, xmq::str name)
+{
+    copies_.recycle();
+    size_t level = (size_t)parent-1;
+    assert(level <= depth_);
+    while (depth_ > level) endElement();
+
+    Level &p = levels_[level];
+    if (p.start_tag_open)
+    {
+        // The first child.
+        out_.put('>');
+        p.start_tag_open = false;
+        if (indent_ && !p.is_inline && kind != Kind::data) out_.put('\n');
+    }
+    else
+    {
+        if (p.pending_newline && indent_ && kind != Kind::data) out_.put('\n');
+        // Two data nodes in a row are always separated.
+        if (p.last == Kind::data && kind == Kind::data) out_.put('\n');
+    }
+    p.pending_newline = false;
+
+    bool is_inline = html_ && isInlineElement(name);
+    if (kind == Kind::element)
+    {
+        // An element continues the line after data and next to html inline elements.
+        bool print_indent = !is_inline && !(p.last != Kind::none && p.last_inline);
+        if (print_indent && p.last != Kind::data) putIndent(level);
+    }
+    else if (kind != Kind::data)
+    {
+        putIndent(level);
+        p.pending_newline = !is_inline;
+    }
+    p.last = kind;
+    p.last_inline = is_inline;
+    return level;
+}
+
+void XMLWriter::endElement()
+{
+    Level &e = levels_[depth_];
+    xmq::str name(e.name.data(), e.name.size());
+    if (e.start_tag_open)
+    {
+        if (html_ && !isVoidElement(name))
+        {
+            out_.put("></", 3);
+            out_.put(name);
+            out_.put('>');
+        }
+        else
+        {
+            out_.put("/>", 2);
+        }
+        e.start_tag_open = false;
+    }
+    else
+    {
+        if (e.pending_newline && indent_) out_.put('\n');
+        if (indent_ && !e.is_inline && e.last != Kind::data) putIndent(depth_-1);
+        out_.put("</", 2);
+        out_.put(name);
+        out_.put('>');
+    }
+    depth_--;
+    levels_[depth_].pending_newline = !e.is_inline;
+}
+
+void *XMLWriter::appendElement(void *parent, xmq::Token t)
+{
+    xmq::str name = tokenText(t);
+    size_t level = enter(parent, Kind::element, name);
+    out_.put('<');
+    out_.put(name);
+
+    depth_ = level+1;
+    if (levels_.size() <= depth_) levels_.resize(depth_+1);
+    Level &e = levels_[depth_];
+    e.name.assign(name.s, name.l);
+    e.start_tag_open = true;
+    e.is_inline = html_ && isInlineElement(name);
+    e.pending_newline = false;
+    e.last = Kind::none;
+    e.last_inline = false;
+    return (void*)(depth_+1);
+}
+
+void XMLWriter::appendComment(void *parent, xmq::Token t)
+{
+    enter(parent, Kind::other, xmq::str("", 0));
+    out_.put("<!--", 4);
+    out_.put(tokenText(t));
+    out_.put("-->", 3);
+}
+
+void XMLWriter::appendData(void *parent, xmq::Token t)
+{
+    enter(parent, Kind::data, xmq::str("", 0));
+    putData(tokenText(t));
+}
+
+void XMLWriter::appendAttribute(void *parent, xmq::Token key, xmq::Token value)
+{
+    // The attributes arrive before the children, while the start tag is open.
+    assert((size_t)parent-1 == depth_ && levels_[depth_].start_tag_open);
+    copies_.recycle();
+    putAttribute(tokenText(key), tokenText(value));
+}
+
+void XMLWriter::appendCData(void *parent, xmq::Token t)
+{
+    enter(parent, Kind::other, xmq::str("", 0));
+    out_.put("<![CDATA[", 9);
+    out_.put(tokenText(t));
+    out_.put("]]>", 3);
+}
+
+void XMLWriter::appendPI(void *parent, xmq::Token name, xmq::Token value)
+{
+    enter(parent, Kind::other, tokenText(name));
+    out_.put("<?", 2);
+    out_.put(tokenText(name));
+    out_.put(' ');
+    out_.put(tokenText(value));
+    out_.put("?>", 2);
+}
+
+void XMLWriter::appendDocType(void *parent, xmq::Token t)
+{
+    enter(parent, Kind::other, xmq::str("", 0));
+    out_.put("<!DOCTYPE ", 10);
+    out_.put(tokenText(t));
+    out_.put('>');
+}
+
+void XMLWriter::appendDeclaration()
+{
+    if (html_)
+    {
+        appendDocType(root(), xmq::Token(xmq::TokenType::text, "html", 4));
+        return;
+    }
+    enter(root(), Kind::other, xmq::str("", 0));
+    out_.put("<?xml", 5);
+    putAttribute(xmq::str("version", 7), xmq::str("1.0", 3));
+    putAttribute(xmq::str("encoding", 8), xmq::str("UTF-8", 5));
+    out_.put("?>", 2);
+}
+
+void XMLWriter::finish()
+{
+    while (depth_ > 0) endElement();
+    Level &d = levels_[0];
+    if (d.pending_newline && indent_) out_.put('\n');
+    d.pending_newline = false;
+    out_.flush();
+    finished_ = true;
+}
@@ -28,6 +28,8 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <stdexcept>
+#include <stdint.h>
 
 #include "string.h"
 
@@ -62,7 +64,7 @@ namespace xmq
         size_t l; // Length of string.
 
         str(const char *st, size_t le) : s(st), l(le) {}
-        bool equals(std::string &st)
+        bool equals(const std::string &st)
         {
             if (l != st.size()) return false;
             return !strncmp(st.c_str(), s, l);
@@ -85,10 +87,14 @@ namespace xmq
 
     struct Token
     {
-        Token(TokenType t, const char *v) : type(t), value(v) { }
+        Token(TokenType t, const char *v) : type(t), value(v), len(v ? strlen(v) : 0) { }
+        Token(TokenType t, const char *v, size_t l) : type(t), value(v), len(l) { }
 
         TokenType type;
-        const char *value; // Zero terminated string allocated by ParseActions::allocateCopy
+        // Zero terminated string allocated by ParseActions::allocateCopy, or a slice of
+        // the input that is not zero terminated, see ParseActions::referToInput.
+        const char *value;
+        size_t len; // Length of value, not counting the zero terminator.
     };
 
     enum class NodeType
@@ -98,6 +104,7 @@ namespace xmq
         close,   // Closing tag. </foo>
         text,    // Text content.
         comment, // Comment.
+        cdata,   // Character data. <![CDATA[
         pi,      // Processing instruction.
         doctype, // Doctype specification. <!DOCTYPE
         declaration // Declaration <?xml version="1.0" encoding="UTF-8"?>
@@ -111,22 +118,32 @@ namespace xmq
         const char *value; // Zero terminated string allocated by ParseActions::allocateCopy
     };
 
+    // The Document links its nodes and attributes using 32 bit indexes into
+    // its vectors, since pointers would break when the vectors grow.
+    // Index 0 is never used for a real entry and means none.
+    // Names and values are offsets into the zero terminated text arena.
     struct Attribute
     {
-        str key;
-        str value;
-        Attribute *next_sibling;
+        uint32_t key;
+        uint32_t key_len;
+        uint32_t value;
+        uint32_t value_len;
+        uint32_t next_sibling;
     };
 
     struct Node
     {
         NodeType type;
-        str name;
-        Node *next_sibling;
-        Node *first_child;
-        Node *last_child;
-        Attribute *first_attribute;
-        Attribute *last_attribute;
+        uint32_t name;
+        uint32_t name_len;
+        uint32_t value;
+        uint32_t value_len;
+        uint32_t parent;
+        uint32_t next_sibling;
+        uint32_t first_child;
+        uint32_t last_child;
+        uint32_t first_attribute;
+        uint32_t last_attribute;
     };
 
     struct RenderActions
@@ -146,33 +163,180 @@ namespace xmq
         virtual bool isNodeDeclaration(void *node) = 0;
         virtual void loadName(void *node, xmq::str *name) = 0;
         virtual void loadValue(void *node, xmq::str *data) = 0;
+        // The type of the node in a single call: open for an element, text for data,
+        // or comment, cdata, pi, doctype, declaration. Override it when the
+        // backend can answer directly, the default asks the isNode functions in turn.
+        virtual NodeType nodeKind(void *node)
+        {
+            if (isNodeData(node)) return NodeType::text;
+            if (isNodeComment(node)) return NodeType::comment;
+            if (isNodeCData(node)) return NodeType::cdata;
+            if (isNodePI(node)) return NodeType::pi;
+            if (isNodeDocType(node)) return NodeType::doctype;
+            if (isNodeDeclaration(node)) return NodeType::declaration;
+            return NodeType::open;
+        }
     };
 
     struct ParseActions
     {
+        virtual ~ParseActions() {}
         virtual void *root() = 0;
         virtual char *allocateCopy(const char *content, size_t len) = 0;
+        // Called instead of allocateCopy for element and attribute names.
+        // The names repeat a lot, thus a copy can be shared between all occurrences.
+        virtual char *allocateName(const char *content, size_t len) { return allocateCopy(content, len); }
+        // Return true to get the names and values that appear as they are in the input,
+        // as slices of the input rather than copies. Such tokens are not zero terminated,
+        // use their len. The input must then outlive the parsed nodes. Parsing from an
+        // InputReader always copies, since the window is reused.
+        virtual bool referToInput() { return false; }
         virtual void *appendElement(void *parent, Token t) = 0;
         virtual void appendComment(void *parent, Token t) = 0;
         virtual void appendData(void *parent, Token t) = 0;
         virtual void appendAttribute(void *parent, Token key, Token value) = 0;
+        // Only xml and html have cdata, processing instructions and doctypes.
+        // By default the cdata is appended as data, the others are dropped.
+        virtual void appendCData(void *parent, Token t) { appendData(parent, t); }
+        virtual void appendPI(void *parent, Token name, Token value) {}
+        virtual void appendDocType(void *parent, Token t) {}
+        // When parsing in parallel, each worker parses a range of the children into its own part.
+        // Return NULL if parts are not supported, the input is then parsed by a single thread.
+        virtual ParseActions *newPart() { return NULL; }
+        // Move the top level nodes of the part last into parent. The part is taken over.
+        virtual void appendPart(void *parent, ParseActions *part) { delete part; }
     };
 
-    struct Document : ParseActions
+    struct Document final : ParseActions
     {
     private:
-        std::vector<Node> nodes;
+        std::vector<Node> nodes; // nodes[1] is the document itself, the parent of the top level nodes.
         std::vector<Attribute> attrs;
-        std::string texts;
-        Node *root_ {};
+        std::vector<char> texts;
+        // When the text arena grows, the old arena is kept until the tokens
+        // pointing into it have been appended.
+        std::vector<std::vector<char>> retired_texts;
+        // Hash table of the names in the text arena. Each distinct name is stored once,
+        // thus the offset of a name identifies it.
+        struct NameSlot
+        {
+            uint32_t offset; // 0 when the slot is empty.
+            uint32_t hash;
+        };
+        std::vector<NameSlot> names;
+        size_t num_names {};
+
+        uint32_t addText(const Token &t, uint32_t *len);
+        void growNames();
+        uint32_t addNode(void *parent, NodeType type, Token name, Token value);
+        void releaseRetiredTexts() { retired_texts.clear(); }
+
     public:
         Document();
         void *root();
         char *allocateCopy(const char *content, size_t len);
+        char *allocateName(const char *content, size_t len);
         void *appendElement(void *parent, Token t);
         void appendComment(void *parent, Token t);
         void appendData(void *parent, Token t);
         void appendAttribute(void *parent, Token key, Token value);
+        void appendCData(void *parent, Token t);
+        void appendPI(void *parent, Token name, Token value);
+        void appendDocType(void *parent, Token t);
+        ParseActions *newPart();
+        void appendPart(void *parent, ParseActions *part);
+        // Remove all nodes, the memory is kept for the next nodes.
+        void clear();
+
+        const Node &node(uint32_t i) { return nodes[i]; }
+        const Attribute &attribute(uint32_t i) { return attrs[i]; }
+        const char *text(uint32_t offset) { return &texts[offset]; }
+
+        // Node handles are the node index shifted left once, attribute handles
+        // are the attribute index shifted left once with the low bit set.
+        static void *nodeHandle(uint32_t i) { return (void*)((uintptr_t)i << 1); }
+        static void *attributeHandle(uint32_t i) { return i == 0 ? NULL : (void*)(((uintptr_t)i << 1) | 1); }
+        static uint32_t handleIndex(void *h) { return (uint32_t)((uintptr_t)h >> 1); }
+        static bool isAttributeHandle(void *h) { return (uintptr_t)h & 1; }
+    };
+
+    // Renders a Document. The functions are defined here, so that the renderer
+    // instantiated for this class can inline them.
+    struct DocumentRenderActions final : RenderActions
+    {
+    private:
+        Document *doc_;
+
+        const Node &node(void *h) { return doc_->node(Document::handleIndex(h)); }
+
+    public:
+        DocumentRenderActions(Document *doc) : doc_(doc) {}
+        void *root() { return Document::nodeHandle(doc_->node(1).first_child); }
+        void *firstNode(void *n) { return Document::nodeHandle(node(n).first_child); }
+        void *nextSibling(void *n) { return Document::nodeHandle(node(n).next_sibling); }
+        bool hasAttributes(void *n) { return node(n).first_attribute != 0; }
+        void *firstAttribute(void *n) { return Document::attributeHandle(node(n).first_attribute); }
+        void *nextAttribute(void *a)
+        {
+            return Document::attributeHandle(doc_->attribute(Document::handleIndex(a)).next_sibling);
+        }
+        void *parent(void *n) { return Document::nodeHandle(node(n).parent); }
+        bool isNodeData(void *n) { return node(n).type == NodeType::text; }
+        bool isNodeComment(void *n) { return node(n).type == NodeType::comment; }
+        bool isNodeCData(void *n) { return node(n).type == NodeType::cdata; }
+        bool isNodePI(void *n) { return node(n).type == NodeType::pi; }
+        bool isNodeDocType(void *n) { return node(n).type == NodeType::doctype; }
+        bool isNodeDeclaration(void *n) { return node(n).type == NodeType::declaration; }
+        NodeType nodeKind(void *n) { return node(n).type; }
+        void loadName(void *n, xmq::str *name)
+        {
+            if (Document::isAttributeHandle(n))
+            {
+                const Attribute &a = doc_->attribute(Document::handleIndex(n));
+                name->s = doc_->text(a.key);
+                name->l = a.key_len;
+                return;
+            }
+            const Node &nn = node(n);
+            name->s = doc_->text(nn.name);
+            name->l = nn.name_len;
+        }
+        void loadValue(void *n, xmq::str *data)
+        {
+            if (Document::isAttributeHandle(n))
+            {
+                const Attribute &a = doc_->attribute(Document::handleIndex(n));
+                data->s = doc_->text(a.value);
+                data->l = a.value_len;
+                return;
+            }
+            const Node &nn = node(n);
+            data->s = doc_->text(nn.value);
+            data->l = nn.value_len;
+        }
+    };
+
+    // Thrown when the input cannot be parsed or the output cannot be written.
+    // The message is complete, with file, line and column when they are known.
+    struct Error : std::runtime_error
+    {
+        Error(const std::string &msg) : std::runtime_error(msg) {}
+    };
+
+    // Supplies the input to the streaming parser piece by piece.
+    struct InputReader
+    {
+        virtual ~InputReader() {}
+        // Copy at most len bytes into buf and return how many were copied.
+        // Return 0 when there is no more input.
+        virtual size_t read(char *buf, size_t len) = 0;
+    };
+
+    // Receives the rendered output in large chunks while rendering is in progress.
+    struct OutputWriter
+    {
+        virtual ~OutputWriter() {}
+        virtual void write(const char *buf, size_t len) = 0;
     };
 
     struct Config
@@ -182,13 +346,36 @@ namespace xmq
         bool use_color {};
         std::set<std::string> excludes; // Exclude these attributes
         const char *root {};
+        TreeType tree_type {}; // When parsing, html permits void elements and attributes without values.
+        bool preserve_ws {}; // When parsing xml, keep the whitespace surrounding the text.
+        // When rendering with more than one thread, the children of the root node are rendered
+        // in parallel. The output is the same. The RenderActions must permit concurrent calls.
+        int render_threads {};
+        // When parsing xmq from a buffer with more than one thread, the children of the top level
+        // elements are parsed in parallel, if the ParseActions supports parts. The result is the same.
+        int parse_threads {};
+        // At most this many key = value lines in a row are aligned together, the following lines
+        // are aligned on their own. 0 means no limit. Rendering xml while it is parsed holds back
+        // the lines of a run, a limit bounds the memory used.
+        size_t align_limit {};
     };
 
     void renderXMQ(RenderActions *actions, std::vector<char> *out, xmq::Config &settings);
+    // Same as above, but the output is handed to the writer as rendering goes.
+    void renderXMQ(RenderActions *actions, OutputWriter *out, xmq::Config &settings);
+    // Render the xml as xmq while it is parsed, without building the whole document.
+    // The output is the same as parsing into a Document and rendering it with a single thread.
+    void renderXMQFromXML(const char *filename, const char *xml, size_t len, OutputWriter *out, xmq::Config &config);
     void parseXMQ(ParseActions *actions, const char *filename, const char *xmq, xmq::Config &config);
+    // Same as above, but the length is known. The xmq must still be zero terminated at len.
+    void parseXMQ(ParseActions *actions, const char *filename, const char *xmq, size_t len, xmq::Config &config);
+    // Parse the xmq while reading it, only the current token needs to fit in memory.
+    void parseXMQ(ParseActions *actions, const char *filename, InputReader *reader, xmq::Config &config);
 
     void renderXML(RenderActions *actions, RenderType rt, bool use_color, std::vector<char> *out, xmq::Config &settings);
-    void parseXML(ParseActions *actions, const char *filename, const char *xmq, xmq::Config &config);
+    void parseXML(ParseActions *actions, const char *filename, const char *xml, xmq::Config &config);
+    // Same as above, but the length is known. The xml must still be zero terminated at len.
+    void parseXML(ParseActions *actions, const char *filename, const char *xml, size_t len, xmq::Config &config);
 }
 
 #endif
@@ -26,23 +26,26 @@
 #include "xmq_implementation.h"
 
 #include<string.h>
-bool xmq_implementation::isWhiteSpace(char c)
-{
-    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
-}
+#include<algorithm>
+#include<stdio.h>
 
-bool xmq_implementation::isNewLine(char c)
+#define XMQ_CLASSES4(i) charClassOf(i), charClassOf(i+1), charClassOf(i+2), charClassOf(i+3)
+#define XMQ_CLASSES16(i) XMQ_CLASSES4(i), XMQ_CLASSES4(i+4), XMQ_CLASSES4(i+8), XMQ_CLASSES4(i+12)
+#define XMQ_CLASSES64(i) XMQ_CLASSES16(i), XMQ_CLASSES16(i+16), XMQ_CLASSES16(i+32), XMQ_CLASSES16(i+48)
+
+constexpr uint8_t xmq_implementation::char_classes[256] =
 {
-    return c == '\n';
-}
+    XMQ_CLASSES64(0), XMQ_CLASSES64(64), XMQ_CLASSES64(128), XMQ_CLASSES64(192)
+};
 
 const char *doctype = "<!DOCTYPE html>";
 const char *html = "<html";
 
-bool xmq_implementation::startsWithLessThan(std::vector<char> &buffer)
+bool xmq_implementation::startsWithLessThan(const char *buffer, size_t len)
 {
-    for (char c : buffer)
+    for (size_t i=0; i<len; ++i)
     {
+        char c = buffer[i];
         if (!xmq_implementation::isWhiteSpace(c))
         {
             return c == '<';
@@ -51,20 +54,20 @@ bool xmq_implementation::startsWithLessThan(std::vector<char> &buffer)
     return false;
 }
 
-bool xmq_implementation::isHtml(std::vector<char> &buffer)
+bool xmq_implementation::isHtml(const char *buffer, size_t buf_len)
 {
     size_t i=0;
-    for (; i<buffer.size(); ++i)
+    for (; i<buf_len; ++i)
     {
         // Skip any whitespace
         if (isWhiteSpace(buffer[i])) continue;
         // First non-whitespace character.
-        if (i+strlen(doctype) < buffer.size() &&
+        if (i+strlen(doctype) < buf_len &&
             !strncasecmp(&buffer[i], doctype, strlen(doctype)))
         {
             return true;
         }
-        if (i+strlen(html) < buffer.size() &&
+        if (i+strlen(html) < buf_len &&
             (!strncasecmp(&buffer[i], html, strlen(html))))
         {
             return true;
@@ -74,17 +77,17 @@ bool xmq_implementation::isHtml(std::vector<char> &buffer)
     return false;
 }
 
-bool xmq_implementation::firstWordIsHtml(std::vector<char> &buffer)
+bool xmq_implementation::firstWordIsHtml(const char *buffer, size_t buf_len)
 {
     size_t i=0;
     size_t len = strlen("html");
 
-    for (; i<buffer.size(); ++i)
+    for (; i<buf_len; ++i)
     {
         // Skip any whitespace
         if (isWhiteSpace(buffer[i])) continue;
         // First non-whitespace character.
-        if (i+len+1 < buffer.size() && (!strncasecmp(&buffer[i], "html", len)))
+        if (i+len+1 < buf_len && (!strncasecmp(&buffer[i], "html", len)))
         {
             // Check that we have "html " "html=123" or "html{"
             if (buffer[i+len] == ' ' || buffer[i+len] == '=' || buffer[i+len] == '{' || buffer[i+len] == '(')
@@ -124,188 +127,342 @@ bool xmq_implementation::firstWordIs(const char *buffer, size_t buf_len, const c
 
 void xmq_implementation::removeIncidentalWhiteSpace(std::vector<char> *buffer, int first_indent)
 {
+    std::vector<char> out;
+    removeIncidentalWhiteSpace(buffer->data(), buffer->size(), first_indent, &out);
+    buffer->swap(out);
+}
+
+void xmq_implementation::removeIncidentalWhiteSpace(const char *s, size_t len, int first_indent, std::vector<char> *out)
+{
+    const char *end = s+len;
     // Check that there are newlines in here!
-    bool found_nl = false;
-    for (size_t i=0; i<buffer->size(); ++i)
+    if (len == 0 || memchr(s, '\n', len) == NULL)
     {
-        if ((*buffer)[i] == '\n') { found_nl = true; break; }
+        out->insert(out->end(), s, end);
+        return;
     }
-    if (!found_nl) return;
 
-    // There is at least one newline!
+    // There is at least one newline! Find the shortest sequence of spaces
+    // that starts the lines ending with a newline, this is the commonly
+    // shared sequence of spaces. The first line counts first_indent as well.
     int common = -1;
     int curr = first_indent;
-    bool looking = true;
-    std::vector<char> copy;
-    // Simulate the indentation in the copy by pushing spaces first.
-    for (int i = 0; i < first_indent-1; ++i)
+    for (const char *line = s;;)
     {
-        copy.push_back(' ');
+        const char *nl = (const char*)memchr(line, '\n', end-line);
+        if (nl == NULL) break;
+        const char *i = line;
+        while (i < nl && *i == ' ') i++;
+        curr += i-line;
+        if (curr < common || common == -1) common = curr;
+        curr = 0;
+        line = nl+1;
     }
-    for (size_t i = 0; i < buffer->size(); ++i)
+
+    // Remove the common spaces from every line, the first line is indented
+    // as if its first_indent-1 preceding characters were spaces.
+    out->reserve(out->size()+len+std::max(first_indent-1, 0));
+    int spaces = std::max(first_indent-1, 0);
+    for (const char *line = s; line < end;)
     {
-        char c = (*buffer)[i];
-//        fprintf(stderr, "%c(%d)\n", c, c);
-        copy.push_back(c);
-        if (c == '\n')
+        const char *nl = (const char*)memchr(line, '\n', end-line);
+        const char *line_end = nl ? nl+1 : end;
+        const char *i = line;
+        while (i < line_end && *i == ' ') i++;
+        spaces += i-line;
+        if (spaces > common) out->insert(out->end(), spaces-common, ' ');
+        out->insert(out->end(), i, line_end);
+        spaces = 0;
+        line = line_end;
+    }
+}
+
+int xmq_implementation::escapingDepth(xmq::str value, bool *add_start_newline, bool *add_end_newline, bool is_attribute)
+{
+    if (value.l == 0) return 0; // No escaping neseccary.
+    const char *s = value.s;
+    const char *end = s+value.l;
+    bool escape = is_attribute;
+    if (value.l > 1 && s[0] == '/' && (s[1] == '/' || s[1] == '*')) escape = true;
+    if (s[0] == '\'') *add_start_newline = true;
+    if (end[-1] == '\'') *add_end_newline = true;
+
+    // Whitespace, quotes and = ( ) { } force quoting, they are exactly the characters
+    // that end an unquoted text. Most values have none and are done after this scan.
+    const char *i = s;
+    for (;;)
+    {
+        i = findReservedCharacter(i, end);
+        if (i == end || *i != 0) break;
+        i++; // A zero byte is content.
+    }
+    if (i == end && !escape) return 0;
+
+    // The depth is one more than the longest run of single quotes, but at least three.
+    int depth = 0;
+    for (const char *q = i; (q = (const char*)memchr(q, '\'', end-q)) != NULL;)
+    {
+        const char *r = q;
+        while (r < end && *r == '\'') r++;
+        if (r-q > depth) depth = r-q;
+        q = r;
+    }
+    if (depth == 0) return 1;
+    if (depth < 3) return 3;
+    return depth+1;
+}
+
+const char *xmq_implementation::findStartingNewline(const char *where, const char *start)
+{
+    while (where > start && *(where-1) != '\n') where--;
+    return where;
+}
+
+const char *xmq_implementation::findEndingNewline(const char *where)
+{
+    while (*where && *where != '\n') where++;
+    return where;
+}
+
+void xmq_implementation::NewlineIndex::lookup(size_t offset, int *line, int *col)
+{
+    if (!built_)
+    {
+        const char *p = buf_;
+        const char *end = buf_+len_;
+        while (p < end && (p = (const char*)memchr(p, '\n', end-p)) != NULL)
         {
-            // We reached end of line.
-            if (curr < common || common == -1)
-            {
-                // We found a shorter sequence of spaces followed by non-whitespace,
-                // use this number as the future commonly shared sequence of spaces.
-/*                if (found_non_ws)
-                  {*/
-                    common = curr;
-//                }
-//                fprintf(stderr, "common %d\n", common);
-            }
-            curr = 0;
-            looking = true;
+            newlines_.push_back(p-buf_);
+            p++;
         }
-        else
+        built_ = true;
+    }
+    // The number of newlines before the offset decides the line.
+    size_t n = std::lower_bound(newlines_.begin(), newlines_.end(), offset) - newlines_.begin();
+    *line = 1+n;
+    *col = n == 0 ? 1+offset : offset-newlines_[n-1];
+}
+
+int xmq_implementation::NameSet::add(const std::string &name)
+{
+    int id = find(name.c_str(), name.size());
+    if (id != -1) return id;
+
+    if (2*(names_.size()+1) > slots_.size())
+    {
+        // Rehash into a table twice the size.
+        std::vector<int> grown(2*slots_.size(), -1);
+        size_t mask = grown.size()-1;
+        for (size_t n = 0; n < names_.size(); ++n)
         {
-            if (looking)
-            {
-                if (c == ' ')
-                {
-                    curr++;
-//                    fprintf(stderr, "curr++ %d\n", curr);
-                }
-                else
-                {
-                    looking = false;
-                }
-            }
+            size_t i = hashes_[n] & mask;
+            while (grown[i] != -1) i = (i+1) & mask;
+            grown[i] = n;
         }
+        slots_.swap(grown);
     }
-    buffer->clear();
+    id = names_.size();
+    names_.push_back(name);
+    hashes_.push_back(hashName(name.c_str(), name.size()));
+    size_t mask = slots_.size()-1;
+    size_t i = hashes_[id] & mask;
+    while (slots_[i] != -1) i = (i+1) & mask;
+    slots_[i] = id;
+    return id;
+}
 
-    curr = common+1;
-    for (size_t i = 0; i < copy.size(); ++i)
+int xmq_implementation::NameSet::find(const char *s, size_t len) const
+{
+    if (names_.size() == 0) return -1;
+    uint32_t h = hashName(s, len);
+    size_t mask = slots_.size()-1;
+    for (size_t i = h & mask; slots_[i] != -1; i = (i+1) & mask)
     {
-        if (copy[i] == '\n')
+        int id = slots_[i];
+        const std::string &n = names_[id];
+        if (hashes_[id] == h && n.size() == len && !memcmp(n.c_str(), s, len)) return id;
+    }
+    return -1;
+}
+
+bool xmq_implementation::matchesPattern(const std::string &pattern, const char *s, size_t len)
+{
+    const char *p = pattern.c_str();
+    const char *pend = p+pattern.size();
+    const char *end = s+len;
+    // Where to continue when the characters after the latest * fail to match.
+    const char *star = NULL;
+    const char *retry = NULL;
+    while (s < end)
+    {
+        if (p < pend && *p == '*')
         {
-            curr = common+1;
-            buffer->push_back('\n');
-            continue;
+            star = ++p;
+            retry = s;
         }
-        if (copy[i] != ' ')
+        else if (p < pend && *p == *s)
         {
-            curr = 0;
+            p++;
+            s++;
         }
-        else
+        else if (star != NULL)
         {
-            if (curr > 0) curr--;
+            p = star;
+            s = ++retry;
         }
-        if (curr == 0)
+        else
         {
-            buffer->push_back(copy[i]);
+            return false;
         }
     }
+    while (p < pend && *p == '*') p++;
+    return p == pend;
 }
 
-int xmq_implementation::escapingDepth(xmq::str value, bool *add_start_newline, bool *add_end_newline, bool is_attribute)
+xmq_implementation::ExcludeMatcher::ExcludeMatcher(const std::set<std::string> &rules)
 {
-    size_t n = 0;
-    if (value.l == 0) return 0; // No escaping neseccary.
-    const char *s = value.s;
-    const char *end = s+value.l;
-    bool escape = false;
-    bool found_quote = false;
-    int depth = 0;
-    if (*s == '/' && *(s+1) == '/') escape = true;
-    if (*s == '/' && *(s+1) == '*') escape = true;
-    const char *q = NULL; // Start of most recently found single quote sequence.
-    if (*s == '\'') *add_start_newline = true;
-    while (s < end)
+    for (auto &r : rules)
     {
-        if (*s == '=' ||
-            *s == '(' ||
-            *s == ')' ||
-            *s == '{' ||
-            *s == '}' ||
-            *s == ' ' ||
-            *s == '\n' ||
-            *s == '\r' ||
-            *s == '\t')
+        size_t at = r.find('@');
+        if (at == std::string::npos)
         {
-            escape = true;
-        }
-        else
-        if (*s == '\'')
-        {
-            found_quote = true;
-            escape = true;
-            if (q == NULL)
-            {
-                q = s;
-                depth = 1;
-            }
-            else
-            {
-                int d = s-q+1;
-                if (d > depth) depth = d;
-            }
+            if (r.find('*') != std::string::npos) element_patterns_.push_back(r);
+            else element_names_.add(r);
+            continue;
         }
-        else
+        std::string element = r.substr(0, at);
+        std::string attribute = r.substr(at+1);
+        if (element == "*") element = "";
+        if (element.find('*') != std::string::npos || attribute.find('*') != std::string::npos)
         {
-            q = NULL;
+            attribute_patterns_.push_back({ element, attribute });
+            continue;
         }
-        s++;
-        n++;
-        if (is_attribute)
+        int id = attribute_names_.add(attribute);
+        if (id == (int)in_any_element_.size())
         {
-            escape = true;
+            in_any_element_.push_back(false);
+            in_elements_.push_back(std::vector<std::string>());
         }
+        if (element == "") in_any_element_[id] = true;
+        else in_elements_[id].push_back(element);
     }
-    if (*(s-1) == '\'') *add_end_newline = true;
+}
 
-    if (escape)
+bool xmq_implementation::ExcludeMatcher::excludeElement(xmq::str element) const
+{
+    if (element_names_.find(element.s, element.l) != -1) return true;
+    for (auto &p : element_patterns_)
     {
-        if (depth == 0)
+        if (matchesPattern(p, element.s, element.l)) return true;
+    }
+    return false;
+}
+
+bool xmq_implementation::ExcludeMatcher::excludeAttribute(xmq::str element, xmq::str attribute) const
+{
+    int id = attribute_names_.find(attribute.s, attribute.l);
+    if (id != -1)
+    {
+        if (in_any_element_[id]) return true;
+        for (auto &e : in_elements_[id])
         {
-            depth = 1;
+            if (element.equals(e)) return true;
         }
-        if (found_quote)
+    }
+    for (auto &p : attribute_patterns_)
+    {
+        if ((p.element == "" || matchesPattern(p.element, element.s, element.l)) &&
+            matchesPattern(p.attribute, attribute.s, attribute.l))
         {
-            if (depth < 3)
-            {
-                depth = 3;
-            }
-            else
-            {
-                depth = depth+1;
-            }
+            return true;
         }
     }
-    return depth;
+    return false;
 }
 
-const char *xmq_implementation::findStartingNewline(const char *where, const char *start)
+std::string xmq_implementation::errorMessage(const char *file, int line, int col, const char *fmt, va_list args)
 {
-    while (where > start && *(where-1) != '\n') where--;
-    return where;
+    char msg[1024];
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    return std::string(file)+":"+std::to_string(line)+":"+std::to_string(col)+": error: "+msg+"\n";
 }
 
-const char *xmq_implementation::findEndingNewline(const char *where)
+std::string xmq_implementation::errorMessage(const char *file, int line, int col, const char *fmt, ...)
 {
-    while (*where && *where != '\n') where++;
-    return where;
+    va_list args;
+    va_start(args, fmt);
+    std::string msg = errorMessage(file, line, col, fmt, args);
+    va_end(args);
+    return msg;
+}
+
+void xmq_implementation::checkUtf8(const char *file, const char *buf, size_t len)
+{
+    const char *bad = findInvalidUtf8(buf, buf+len);
+    if (bad == buf+len) return;
+    int line, col;
+    NewlineIndex index(buf, len);
+    index.lookup(bad-buf, &line, &col);
+    throw xmq::Error(errorMessage(file, line, col, "invalid utf8"));
 }
 
-void xmq_implementation::findLineAndColumn(const char *from, const char *where, int *line, int *col)
+void xmq_implementation::OutputSink::putEscaped(const char *s, size_t len)
 {
-    *line = 1;
-    *col = 1;
-    for (const char *i = from; *i != 0; ++i)
+    const char *end = s+len;
+    const char *run = s;
+    while (s < end)
     {
-        (*col)++;
-        if (*i == '\n')
+        if (!hasCharClass(*s, html_special))
+        {
+            s++;
+            continue;
+        }
+        const char *escape = NULL;
+        switch (*s)
+        {
+        case '&': escape = "&amp;"; break;
+        case '<': escape = "&lt;"; break;
+        case '>': escape = "&gt;"; break;
+        }
+        if (escape != NULL)
         {
-            (*line)++;
-            (*col)=1;
+            append(run, s-run);
+            append(escape, strlen(escape));
+            run = s+1;
         }
-        if (i == where) break;
+        s++;
     }
+    append(run, end-run);
+}
+
+char *xmq_implementation::TokenCopies::copy(const char *content, size_t len)
+{
+    if (used_ == copies_.size()) copies_.push_back(std::vector<char>());
+    std::vector<char> &c = copies_[used_++];
+    c.assign(content, content+len-1);
+    c.push_back(0);
+    return c.data();
+}
+
+void xmq_implementation::OutputSink::putRepeat(char c, int n)
+{
+    while (n > 0)
+    {
+        if (used_ == buf_.size()) flush();
+        size_t m = std::min((size_t)n, buf_.size()-used_);
+        memset(&buf_[used_], c, m);
+        used_ += m;
+        n -= m;
+    }
+}
+
+void xmq_implementation::OutputSink::flush()
+{
+    if (used_ == 0) return;
+    // Forget the output before writing it, a write that throws is not retried
+    // when the sink is destroyed during the unwinding.
+    size_t n = used_;
+    used_ = 0;
+    writer_->write(&buf_[0], n);
 }
@@ -27,23 +27,292 @@
 
 #include "xmq.h"
 
+#include<set>
 #include<vector>
 #include<string.h>
+#include<stdarg.h>
+#include<string>
+#include<stdint.h>
 
 namespace xmq_implementation
 {
-    bool startsWithLessThan(std::vector<char> &buffer);
-    bool isWhiteSpace(char c);
-    bool isNewLine(char c);
-    bool isHtml(std::vector<char> &buffer);
-    bool firstWordIsHtml(std::vector<char> &buffer);
+    // The character classes, a byte can belong to several of them.
+    enum CharClass : uint8_t
+    {
+        whitespace = 1,   // space tab cr newline
+        reserved = 2,     // Ends an unquoted xmq text: whitespace ' = { } ( ) or zero.
+        quote = 4,        // '
+        line_break = 8,   // cr newline
+        html_special = 16, // & < > are escaped in html output.
+        utf8_lead2 = 32,   // Starts a valid utf8 sequence of two bytes.
+        utf8_lead3 = 64,   // Of three bytes.
+        utf8_lead4 = 128   // Of four bytes.
+    };
+
+    constexpr uint8_t charClassOf(unsigned char c)
+    {
+        return (c == ' ' || c == '\t' || c == '\r' || c == '\n' ? whitespace | reserved : 0) |
+            (c == 0 || c == '=' || c == '{' || c == '}' || c == '(' || c == ')' ? reserved : 0) |
+            (c == '\'' ? quote | reserved : 0) |
+            (c == '\r' || c == '\n' ? line_break : 0) |
+            (c == '&' || c == '<' || c == '>' ? html_special : 0) |
+            (c >= 0xc2 && c <= 0xdf ? utf8_lead2 : 0) |
+            (c >= 0xe0 && c <= 0xef ? utf8_lead3 : 0) |
+            (c >= 0xf0 && c <= 0xf4 ? utf8_lead4 : 0);
+    }
+
+    // The classes of all bytes, generated at compile time from charClassOf.
+    extern const uint8_t char_classes[256];
+
+    inline bool hasCharClass(char c, uint8_t classes) { return char_classes[(unsigned char)c] & classes; }
+    inline bool isWhiteSpace(char c) { return hasCharClass(c, whitespace); }
+    inline bool isReserved(char c) { return hasCharClass(c, reserved); }
+
+    // FNV-1a, used for the tables of element and attribute names.
+    inline uint32_t hashName(const char *s, size_t len)
+    {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i)
+        {
+            h ^= (unsigned char)s[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    bool startsWithLessThan(const char *buffer, size_t len);
+    bool isHtml(const char *buffer, size_t len);
+    bool firstWordIsHtml(const char *buffer, size_t len);
     bool firstWordIs(const char *b, size_t len, const char *word);
     void removeIncidentalWhiteSpace(std::vector<char> *buffer, int first_indent);
+    // Same as above, but the text is taken from [s,s+len) and the result is appended to out.
+    void removeIncidentalWhiteSpace(const char *s, size_t len, int first_indent, std::vector<char> *out);
     int  escapingDepth(xmq::str value, bool *add_start_newline, bool *add_end_newline, bool is_attribute);
     const char *findStartingNewline(const char *where, const char *start);
     const char *findEndingNewline(const char *where);
-    void findLineAndColumn(const char *from, const char *where, int *line, int *col);
+    // Vectorised scanners, implemented in scan.cc. They look at the bytes in [p,end)
+    // and return the first position that stops the scan, or end.
+    // Stop at the first byte that is not space, tab, cr or newline.
+    const char *skipWhiteSpace(const char *p, const char *end);
+    // Stop at the first byte that ends an unquoted xmq text: whitespace ' = { } ( ) or zero.
+    const char *findReservedCharacter(const char *p, const char *end);
+    // Stop at the first c or zero.
+    const char *findCharOrZero(const char *p, const char *end, char c);
+    size_t countNewlines(const char *p, const char *end);
+    // Stop at the first byte that starts an invalid utf8 sequence. Runs of ascii are skipped a vector
+    // at a time. Overlong forms, surrogates, code points above 0x10ffff and truncated sequences are invalid.
+    const char *findInvalidUtf8(const char *p, const char *end);
+    // Throw an xmq::Error with the line and column of the first invalid utf8 sequence, if there is one.
+    void checkUtf8(const char *file, const char *buf, size_t len);
+    // Pre-scan for parsing the children of an element in parallel. Starts at offset p, just after
+    // the opening brace of the element, and steps over the tokens, quotes and comments, built on
+    // the scanners above, until the closing brace of the element. Stores the offsets just after
+    // the closing braces of the children, at least min_gap bytes apart, and last the offset of the
+    // closing brace of the element. Returns false if the input looks broken, the parser can then
+    // find and report the error.
+    bool findChildBoundaries(const char *buf, size_t len, size_t p, size_t min_gap, std::vector<size_t> *splits);
+    // Format a parse error message as: file:line:col: error: message
+    std::string errorMessage(const char *file, int line, int col, const char *fmt, va_list args);
+    std::string errorMessage(const char *file, int line, int col, const char *fmt, ...);
+
+    // Finds the line and column of an offset into a buffer. The parsers only keep
+    // an offset while parsing, the newlines are indexed the first time a position
+    // is looked up, which only happens when an error is reported.
+    struct NewlineIndex
+    {
+        NewlineIndex(const char *buf, size_t len) : buf_(buf), len_(len) {}
+        // Line and column count from 1. The column counts bytes, not characters.
+        void lookup(size_t offset, int *line, int *col);
+
+    private:
+        const char *buf_;
+        size_t len_;
+        bool built_ {};
+        std::vector<size_t> newlines_; // Offsets of the newlines, in order.
+    };
+
+    // Hash set of names that are looked up without allocating.
+    // Each name gets an id, the index of the name in the order added.
+    struct NameSet
+    {
+        NameSet() : slots_(16, -1) {}
+        int add(const std::string &name);
+        // Return the id of the name, or -1 if it is not in the set.
+        int find(const char *s, size_t len) const;
+        size_t size() const { return names_.size(); }
+
+    private:
+        std::vector<int> slots_; // Ids, -1 for empty slots.
+        std::vector<std::string> names_;
+        std::vector<uint32_t> hashes_;
+    };
+
+    // Decides what the renderer leaves out. The rules are given as:
+    // @attr excludes the attribute from all elements, elem@attr from elem only,
+    // and elem the whole element. A * in a name matches any characters.
+    // The rules are compiled once, the rules without a * are found through
+    // hash lookups and only the rules with a * are tried one by one.
+    struct ExcludeMatcher
+    {
+        ExcludeMatcher(const std::set<std::string> &rules);
+        bool hasElementRules() const { return element_names_.size() > 0 || element_patterns_.size() > 0; }
+        bool hasAttributeRules() const { return attribute_names_.size() > 0 || attribute_patterns_.size() > 0; }
+        bool excludeElement(xmq::str element) const;
+        bool excludeAttribute(xmq::str element, xmq::str attribute) const;
+
+    private:
+        NameSet element_names_;
+        std::vector<std::string> element_patterns_;
+        // Indexed by the id of the attribute name.
+        NameSet attribute_names_;
+        std::vector<bool> in_any_element_;
+        std::vector<std::vector<std::string>> in_elements_;
+        struct Pattern
+        {
+            std::string element; // Empty for any element.
+            std::string attribute;
+        };
+        std::vector<Pattern> attribute_patterns_;
+    };
+    // Match s against a pattern where * matches any characters.
+    bool matchesPattern(const std::string &pattern, const char *s, size_t len);
+
+    // How text put into an OutputSink is escaped.
+    // Tex output carries no markup and needs no escaping.
+    enum class Escape { none, html };
+
+    // Collects rendered text into large chunks that are handed to an OutputWriter,
+    // escaping the text on the way. Runs of characters that need no escaping are copied in bulk.
+    struct OutputSink
+    {
+        OutputSink(xmq::OutputWriter *w, Escape e) : writer_(w), escape_(e), buf_(65536) {}
+        // The renderers flush when they are done. This flush only matters when rendering
+        // was interrupted by an error, then a failing write must not throw again.
+        ~OutputSink() { try { flush(); } catch (...) { } }
+
+        void put(char c)
+        {
+            if (escape_ != Escape::none) { putEscaped(&c, 1); return; }
+            if (used_ == buf_.size()) flush();
+            buf_[used_++] = c;
+        }
+        void put(const char *s, size_t len)
+        {
+            if (escape_ == Escape::none) append(s, len);
+            else putEscaped(s, len);
+        }
+        void put(xmq::str s) { put(s.s, s.l); }
+        void put(const char *s) { put(s, strlen(s)); }
+        // The repeated character must not need escaping, typically a space.
+        void putRepeat(char c, int n);
+        // Put text that is already escaped, like color sequences.
+        void putRaw(const char *s) { append(s, strlen(s)); }
+        void putRaw(const char *s, size_t len) { append(s, len); }
+        // Hand over what has been collected so far to the writer.
+        void flush();
+        // Forget what has been collected since the last flush.
+        void discard() { used_ = 0; }
+
+    private:
+        xmq::OutputWriter *writer_;
+        Escape escape_;
+        std::vector<char> buf_;
+        size_t used_ {};
+
+        void append(const char *s, size_t len)
+        {
+            if (len > buf_.size()-used_)
+            {
+                flush();
+                if (len >= buf_.size())
+                {
+                    writer_->write(s, len);
+                    return;
+                }
+            }
+            memcpy(&buf_[used_], s, len);
+            used_ += len;
+        }
+        void putEscaped(const char *s, size_t len);
+    };
+
+    // Appends the output to a vector.
+    struct VectorOutputWriter : xmq::OutputWriter
+    {
+        VectorOutputWriter(std::vector<char> *out) : out_(out) {}
+        void write(const char *buf, size_t len) { out_->insert(out_->end(), buf, buf+len); }
+
+    private:
+        std::vector<char> *out_;
+    };
+
+    // The copies of the tokens for a consumer that writes each token as soon as it is appended,
+    // like the XMLWriter. Each append starts by recycling the copies, the tokens it was given
+    // are still intact since nothing is copied while it runs.
+    struct TokenCopies
+    {
+        char *copy(const char *content, size_t len);
+        void recycle() { used_ = 0; }
+
+    private:
+        std::vector<std::vector<char>> copies_;
+        size_t used_ {};
+    };
+
+    // Writes xml, or html, while the xmq is parsed, without building a tree. The output
+    // is the same as rapidxml prints from the parsed tree. A node is written as soon as
+    // it arrives, only the end of the start tag and the newline after a node wait for
+    // the next event, since they depend on whether children or data follow. An element
+    // ends when a node is appended to one of its ancestors, or when finish is called.
+    // Memory use is proportional to the nesting depth.
+    struct XMLWriter : xmq::ParseActions
+    {
+        XMLWriter(xmq::OutputWriter *w, bool html, bool indent) : out_(w, Escape::none), html_(html), indent_(indent) {}
+        // A parse error leaves finish uncalled, then the output that is still buffered is dropped.
+        ~XMLWriter() { if (!finished_) out_.discard(); }
+
+        void *root() { return (void*)1; }
+        char *allocateCopy(const char *content, size_t len) { return copies_.copy(content, len); }
+        // The tokens are written right away, thus they can point into the input.
+        bool referToInput() { return true; }
+        void *appendElement(void *parent, xmq::Token t);
+        void appendComment(void *parent, xmq::Token t);
+        void appendData(void *parent, xmq::Token t);
+        void appendAttribute(void *parent, xmq::Token key, xmq::Token value);
+        void appendCData(void *parent, xmq::Token t);
+        void appendPI(void *parent, xmq::Token name, xmq::Token value);
+        void appendDocType(void *parent, xmq::Token t);
+        // Write <?xml version="1.0" encoding="UTF-8"?>, or <!DOCTYPE html> for html, first.
+        void appendDeclaration();
+        // End the elements that are still open and flush the output.
+        void finish();
+
+    private:
+        enum class Kind { none, element, data, other };
+        // The document is level 0, the handle of level i is i+1.
+        struct Level
+        {
+            std::string name;
+            bool start_tag_open {};  // The > of the start tag has not been written.
+            bool is_inline {};       // An html inline element, its children are not put on lines of their own.
+            bool pending_newline {}; // The last child ends its line, unless data follows.
+            Kind last {};            // The kind of the last child.
+            bool last_inline {};     // The last child was an html inline element.
+        };
+        OutputSink out_;
+        bool html_ {};
+        bool indent_ {};
+        std::vector<Level> levels_ {1};
+        size_t depth_ {}; // The deepest level that is open.
+        bool finished_ {};
+        TokenCopies copies_;
 
+        size_t enter(void *parent, Kind kind, xmq::str name);
+        void endElement();
+        void putIndent(size_t level);
+        void putData(xmq::str s);
+        void putAttribute(xmq::str key, xmq::str value);
+    };
 }
 
 #endif
@@ -29,13 +29,41 @@
 
 #include "rapidxml/rapidxml.hpp"
 
-struct ParseActionsRapidXML : xmq::ParseActions
+#include <string.h>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+struct ParseActionsRapidXML final : xmq::ParseActions
 {
 private:
     rapidxml::xml_document<> *doc;
+    // The names and values that appear as they are in the input point into the input.
+    bool refer_to_input {};
+
+    // The names allocated so far, each distinct name is only copied once into the document.
+    struct Name
+    {
+        const char *s;
+        size_t len;
+        bool operator==(const Name &n) const { return len == n.len && !memcmp(s, n.s, len); }
+    };
+    struct NameHash
+    {
+        // In the library, it shares the hash of the other name tables.
+        size_t operator()(const Name &n) const;
+    };
+    std::unordered_set<Name,NameHash> names;
+
+    // A part owns its document. The nodes moved out of a part stay in the memory of the part,
+    // thus the parts that have been appended are kept for as long as these ParseActions live.
+    std::unique_ptr<rapidxml::xml_document<>> part_doc;
+    std::vector<std::unique_ptr<ParseActionsRapidXML>> parts;
 
 public:
-    ParseActionsRapidXML(rapidxml::xml_document<> *d) : doc(d) {}
+    // With refer_to_input the document points into the parsed input, which must outlive it.
+    ParseActionsRapidXML(rapidxml::xml_document<> *d, bool refer_to_input = false) :
+        doc(d), refer_to_input(refer_to_input) {}
 
     void *root()
     {
@@ -44,13 +72,40 @@ public:
 
     char *allocateCopy(const char *content, size_t len)
     {
-        return doc->allocate_string(content, len);
+        // The length counts the terminating zero, which need not follow the content.
+        char *s = doc->allocate_string(NULL, len);
+        memcpy(s, content, len-1);
+        s[len-1] = 0;
+        return s;
+    }
+
+    char *allocateName(const char *content, size_t len)
+    {
+        auto i = names.find(Name { content, len-1 });
+        if (i != names.end()) return (char*)i->s;
+        char *s = allocateCopy(content, len);
+        names.insert(Name { s, len-1 });
+        return s;
+    }
+
+    bool referToInput()
+    {
+        return refer_to_input;
+    }
+
+    // The sizes are always given, since the tokens need not be zero terminated.
+    rapidxml::xml_node<> *allocateNode(rapidxml::node_type type, const xmq::Token *name, const xmq::Token *val)
+    {
+        rapidxml::xml_node<> *n = doc->allocate_node(type);
+        if (name) n->name(name->value, name->len);
+        if (val) n->value(val->value, val->len);
+        return n;
     }
 
     void *appendElement(void *parent, xmq::Token t)
     {
         rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
-        rapidxml::xml_node<> *n = doc->allocate_node(rapidxml::node_element, t.value);
+        rapidxml::xml_node<> *n = allocateNode(rapidxml::node_element, &t, NULL);
         p->append_node(n);
         return n;
     }
@@ -58,24 +113,64 @@ public:
     void appendComment(void *parent, xmq::Token t)
     {
         rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
-        p->append_node(doc->allocate_node(rapidxml::node_comment, NULL, t.value));
+        p->append_node(allocateNode(rapidxml::node_comment, NULL, &t));
     }
 
     void appendData(void *parent, xmq::Token t)
     {
         rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
-        p->append_node(doc->allocate_node(rapidxml::node_data, NULL, t.value));
+        p->append_node(allocateNode(rapidxml::node_data, NULL, &t));
     }
 
     void appendAttribute(void *parent, xmq::Token key, xmq::Token val)
     {
         rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
-        p->append_attribute(doc->allocate_attribute(key.value, val.value));
+        rapidxml::xml_attribute<> *a = doc->allocate_attribute();
+        a->name(key.value, key.len);
+        a->value(val.value, val.len);
+        p->append_attribute(a);
+    }
+
+    void appendCData(void *parent, xmq::Token t)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        p->append_node(allocateNode(rapidxml::node_cdata, NULL, &t));
+    }
+
+    void appendPI(void *parent, xmq::Token name, xmq::Token val)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        p->append_node(allocateNode(rapidxml::node_pi, &name, &val));
+    }
+
+    void appendDocType(void *parent, xmq::Token t)
+    {
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        p->append_node(allocateNode(rapidxml::node_doctype, NULL, &t));
+    }
+
+    xmq::ParseActions *newPart()
+    {
+        ParseActionsRapidXML *part = new ParseActionsRapidXML(new rapidxml::xml_document<>(), refer_to_input);
+        part->part_doc.reset(part->doc);
+        return part;
+    }
+
+    void appendPart(void *parent, xmq::ParseActions *pa)
+    {
+        ParseActionsRapidXML *part = (ParseActionsRapidXML*)pa;
+        parts.push_back(std::unique_ptr<ParseActionsRapidXML>(part));
+        rapidxml::xml_node<> *p = (rapidxml::xml_node<>*)parent;
+        while (rapidxml::xml_node<> *n = part->doc->first_node())
+        {
+            part->doc->remove_first_node();
+            p->append_node(n);
+        }
     }
 
 };
 
-struct RenderActionsRapidXML : xmq::RenderActions
+struct RenderActionsRapidXML final : xmq::RenderActions
 {
 private:
     rapidxml::xml_node<> *root_;
@@ -155,6 +250,21 @@ public:
         return n->type() == rapidxml::node_declaration;
     }
 
+    xmq::NodeType nodeKind(void *node)
+    {
+        rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
+        switch (n->type())
+        {
+        case rapidxml::node_data: return xmq::NodeType::text;
+        case rapidxml::node_comment: return xmq::NodeType::comment;
+        case rapidxml::node_cdata: return xmq::NodeType::cdata;
+        case rapidxml::node_pi: return xmq::NodeType::pi;
+        case rapidxml::node_doctype: return xmq::NodeType::doctype;
+        case rapidxml::node_declaration: return xmq::NodeType::declaration;
+        default: return xmq::NodeType::open;
+        }
+    }
+
     void loadName(void *node, xmq::str *name)
     {
         rapidxml::xml_node<> *n = (rapidxml::xml_node<>*)node;
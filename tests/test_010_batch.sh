@@ -0,0 +1,51 @@
+#!/bin/bash
+
+TEST=$(basename "$0" | sed 's/.sh//')
+echo $TEST
+XMQ="$1"
+OUT="$2/$TEST"
+
+rm -rf $OUT
+mkdir -p $OUT/in $OUT/out
+
+cp tests/test_001_basic.xml tests/test_009_newlines.xml $OUT/in
+$XMQ tests/test_001_basic.xml > $OUT/in/expected_001.xmq
+$XMQ tests/test_009_newlines.xml > $OUT/in/expected_009.xmq
+
+# Outputs are written into the outdir.
+$XMQ --batch -j 2 --outdir=$OUT/out $OUT/in/test_001_basic.xml $OUT/in/test_009_newlines.xml
+if [ "$?" != "0" ]; then exit 1; fi
+diff $OUT/out/test_001_basic.xmq $OUT/in/expected_001.xmq
+if [ "$?" != "0" ]; then exit 1; fi
+diff $OUT/out/test_009_newlines.xmq $OUT/in/expected_009.xmq
+if [ "$?" != "0" ]; then exit 1; fi
+
+# Outputs are written next to the inputs, converting back to xml.
+cp $OUT/out/test_001_basic.xmq $OUT/out/test_009_newlines.xmq $OUT/in
+echo "$OUT/in/test_001_basic.xmq" > $OUT/list
+echo "$OUT/in/test_009_newlines.xmq" >> $OUT/list
+rm $OUT/in/test_001_basic.xml $OUT/in/test_009_newlines.xml
+$XMQ --files-from=$OUT/list
+if [ "$?" != "0" ]; then exit 1; fi
+diff $OUT/in/test_001_basic.xml tests/test_001_basic.xml
+if [ "$?" != "0" ]; then exit 1; fi
+diff $OUT/in/test_009_newlines.xml tests/test_009_newlines.xml
+if [ "$?" != "0" ]; then exit 1; fi
+
+# A job that would overwrite the input of another job refuses the whole batch.
+mkdir -p $OUT/clash/a $OUT/clash/b $OUT/clash/out
+cp tests/test_001_basic.xml $OUT/clash/a/foo.xml
+cp $OUT/in/expected_009.xmq $OUT/clash/a/foo.xmq
+$XMQ --batch -j 2 $OUT/clash/a/foo.xml $OUT/clash/a/foo.xmq 2> $OUT/clash/err
+if [ "$?" = "0" ]; then exit 1; fi
+diff $OUT/clash/a/foo.xml tests/test_001_basic.xml
+if [ "$?" != "0" ]; then exit 1; fi
+diff $OUT/clash/a/foo.xmq $OUT/in/expected_009.xmq
+if [ "$?" != "0" ]; then exit 1; fi
+
+# Two jobs that would write the same output refuse the whole batch.
+rm $OUT/clash/a/foo.xmq
+cp tests/test_009_newlines.xml $OUT/clash/b/foo.xml
+$XMQ --batch -j 2 --outdir=$OUT/clash/out $OUT/clash/a/foo.xml $OUT/clash/b/foo.xml 2> $OUT/clash/err
+if [ "$?" = "0" ]; then exit 1; fi
+if [ -n "$(ls $OUT/clash/out)" ]; then exit 1; fi
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+TEST=$(basename "$0" | sed 's/.sh//')
+echo $TEST
+XMQ="$1"
+OUT="$2/$TEST"
+
+rm -rf $OUT
+mkdir -p $OUT
+
+# A run of more than 10000 aligned lines, the longest key comes last.
+(echo "<r>"; for i in $(seq 0 10000); do echo "<k>$i</k>"; done; echo "<kk>x</kk></r>") > $OUT/run.xml
+
+# There is no limit by default, whichever way the xml is converted.
+$XMQ $OUT/run.xml > $OUT/out.xmq
+if [ "$(grep -c '^    k  = ' $OUT/out.xmq)" != "10001" ]; then exit 1; fi
+$XMQ -j 2 $OUT/run.xml > $OUT/out_j2.xmq
+diff $OUT/out.xmq $OUT/out_j2.xmq
+if [ "$?" != "0" ]; then exit 1; fi
+
+# The same limit applies to all paths.
+$XMQ --align=1000 $OUT/run.xml > $OUT/out_limit.xmq
+$XMQ --align=1000 -j 2 $OUT/run.xml > $OUT/out_limit_j2.xmq
+diff $OUT/out_limit.xmq $OUT/out_limit_j2.xmq
+if [ "$?" != "0" ]; then exit 1; fi
+if [ "$(grep -c '^    k  = ' $OUT/out_limit.xmq)" != "1" ]; then exit 1; fi